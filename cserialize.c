@@ -1,5 +1,12 @@
 #include "Python.h"
 
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #if PY_VERSION_HEX < 0x02050000
 typedef int Py_ssize_t;
 #define PY_SSIZE_T_MAX INT_MAX
@@ -99,44 +106,124 @@ static prefix_t *prefix_find_uri(prefix_t **list, char *uri, int *counter)
     return item;
 }
 
-static int encode(char *val, int size, int attr, char *buf, int pos, int len)
+/* do_serialize return values other than the new buffer position */
+#define SERIALIZE_BAD_TREE -1
+#define SERIALIZE_FULL -2
+
+/* what encode() does with characters that are not allowed in XML 1.0 */
+#define SANITIZE_NONE 0
+#define SANITIZE_DROP 1
+#define SANITIZE_REPLACE 2
+
+#define REPLACEMENT_CHAR "\xef\xbf\xbd"
+
+/* byte classes for encode().  plain bytes are copied in runs, and only
+ * the rest go through the switch.  escape_class is used when not
+ * sanitizing, sanitize_class also flags control characters and the lead
+ * bytes of surrogates (0xed) and U+FFFE/U+FFFF (0xef).
+ */
+#define CLASS_PLAIN 0
+#define CLASS_SPECIAL 1
+#define CLASS_CONTROL 2
+#define CLASS_LEAD 3
+
+/* the UTF-8 of a surrogate, U+FFFE or U+FFFF starts at v[c] */
+#define ILLEGAL_SEQUENCE(v, c, size)                                    \
+    ((c) + 2 < (size) &&                                                \
+     (((v)[c] == 0xed && (v)[(c) + 1] >= 0xa0) ||                       \
+      ((v)[c] == 0xef && (v)[(c) + 1] == 0xbf && (v)[(c) + 2] >= 0xbe)))
+
+static unsigned char escape_class[256];
+static unsigned char sanitize_class[256];
+
+static void init_encode_tables(void)
 {
     int c;
 
-    for (c = 0; c < size; c++) {
-        switch (val[c]) {
-        case '&':
-            if (5 > (len - pos))
-                return 0;
-            strncpy(&buf[pos], "&amp;", 5);
-            pos += 5;
-            break;
-        case '<':
-            if (4 > (len - pos))
-                return 0;
+    for (c = 0; c < 0x20; c++) {
+        if (c != '\t' && c != '\n' && c != '\r')
+            sanitize_class[c] = CLASS_CONTROL;
+    }
+    sanitize_class[0xed] = CLASS_LEAD;
+    sanitize_class[0xef] = CLASS_LEAD;
+
+    escape_class['&'] = sanitize_class['&'] = CLASS_SPECIAL;
+    escape_class['<'] = sanitize_class['<'] = CLASS_SPECIAL;
+    escape_class['>'] = sanitize_class['>'] = CLASS_SPECIAL;
+    escape_class['\''] = sanitize_class['\''] = CLASS_SPECIAL;
+}
+
+/* write an escaped copy of val at buf[pos].  returns the new position,
+ * or SERIALIZE_FULL if it doesn't fit.
+ */
+static int encode(char *val, int size, int attr, int sanitize,
+                  char *buf, int pos, int len)
+{
+    const unsigned char *table;
+    const unsigned char *v = (const unsigned char *)val;
+    const char *rep;
+    int c, start, replen;
+
+    table = sanitize ? sanitize_class : escape_class;
+
+    c = 0;
+    while (c < size) {
+        /* copy the run of bytes that need no attention */
+        start = c;
+        while (c < size && table[v[c]] == CLASS_PLAIN)
+            c++;
+        if (c > start) {
+            if (c - start > (len - pos))
+                return SERIALIZE_FULL;
+            memcpy(&buf[pos], &val[start], c - start);
+            pos += c - start;
+            if (c == size)
+                break;
+        }
 
-            strncpy(&buf[pos], "&lt;", 4);
-            pos += 4;
+        rep = NULL;
+        replen = 1;
+        switch (table[v[c]]) {
+        case CLASS_SPECIAL:
+            switch (val[c]) {
+            case '&': rep = "&amp;"; replen = 5; break;
+            case '<': rep = "&lt;"; replen = 4; break;
+            case '>': rep = "&gt;"; replen = 4; break;
+            case '\'':
+                if (attr) {
+                    rep = "&apos;";
+                    replen = 6;
+                }
+                break;
+            }
             break;
-        case '>':
-            if (4 > (len - pos))
-                return 0;
-            strncpy(&buf[pos], "&gt;", 4);
-            pos += 4;
+        case CLASS_CONTROL:
+            replen = 0;
             break;
-        case '\'':
-            if (attr) {
-                if (6 > (len - pos))
-                    return 0;
-                strncpy(&buf[pos], "&apos;", 6);
-                pos += 6;
-                break;
+        case CLASS_LEAD:
+            if (ILLEGAL_SEQUENCE(v, c, size)) {
+                replen = 0;
+                c += 2;
+            }
+            break;
+        }
+
+        if (replen == 0) {
+            /* an illegal character */
+            if (sanitize == SANITIZE_REPLACE) {
+                rep = REPLACEMENT_CHAR;
+                replen = 3;
             }
-        default:
-            if (1 > (len - pos))
-                return 0;
-            buf[pos++] = val[c];
         }
+
+        if (replen > (len - pos))
+            return SERIALIZE_FULL;
+        if (rep)
+            memcpy(&buf[pos], rep, replen);
+        else if (replen)
+            buf[pos] = val[c];
+        pos += replen;
+        c++;
     }
 
     return pos;
@@ -221,27 +308,225 @@ static int convert_from_dict(PyObject *dict, prefix_t **list)
     return 0;
 }
 
+/* the pieces of element serialization that only touch C data.  each
+ * write_* function returns the new buffer position or SERIALIZE_FULL.
+ */
+
+/* add an element's localPrefixes to the prefix list, unless the prefix
+ * is already taken.  lprefixes is consumed.
+ */
+static void merge_local_prefixes(prefix_t *prefixes, prefix_t *lprefixes)
+{
+    prefix_t *prefix, *found, *next;
+
+    prefix = lprefixes;
+    while (prefix) {
+        next = prefix->next;
+        prefix->next = NULL;
+        for (found = prefixes; found; found = found->next) {
+            if (strcmp(found->prefix, prefix->prefix) == 0)
+                break;
+        }
+
+        if (!found) {
+            prefix_append(prefixes, prefix);
+        } else {
+            prefix_free(prefix);
+        }
+
+        prefix = next;
+    }
+}
+
+/* find the prefix, if any, for an element in namespace uri_s */
+static prefix_t *resolve_name_prefix(prefix_t *prefixes, char *uri_s,
+                                     char *defUri_s, int *prefixCounter)
+{
+    prefix_t *prefix;
+
+    for (prefix = prefixes; prefix; prefix = prefix->next) {
+        if (strcmp(prefix->uri, uri_s) == 0)
+            break;
+    }
+
+    if (defUri_s && strcmp(uri_s, defUri_s) != 0)
+        prefix = prefix_find_uri(&prefixes, uri_s, prefixCounter);
+
+    if (prefix && !prefix->in_scope) {
+        prefix->needs_write = 1;
+        prefix->in_scope = 1;
+    }
+
+    return prefix;
+}
+
+static prefix_t *resolve_attr_prefix(prefix_t *prefixes, char *ns,
+                                     int *prefixCounter)
+{
+    prefix_t *prefix;
+
+    prefix = prefix_find_uri(&prefixes, ns, prefixCounter);
+    if (!prefix->in_scope) prefix->needs_write = 1;
+
+    return prefix;
+}
+
+static int write_content(char *s, int size, int raw, int sanitize,
+                         char *buf, int pos, int len)
+{
+    if (!raw)
+        return encode(s, size, 0, sanitize, buf, pos, len);
+
+    if (size > len - pos)
+        return SERIALIZE_FULL;
+    memcpy(&buf[pos], s, size);
+    return pos + size;
+}
+
+/* write "<name" for a start tag, or "</name>" for an end tag */
+static int write_name(prefix_t *nameprefix, char *name, int namesize,
+                      int end, char *buf, int pos, int len)
+{
+    int size;
+
+    size = nameprefix ? strlen(nameprefix->prefix) + 1 : 0;
+    if (namesize + size + (end ? 3 : 1) > (len - pos))
+        return SERIALIZE_FULL;
+
+    buf[pos++] = '<';
+    if (end)
+        buf[pos++] = '/';
+    if (nameprefix) {
+        memcpy(&buf[pos], nameprefix->prefix, size - 1);
+        pos += size - 1;
+        buf[pos++] = ':';
+    }
+    memcpy(&buf[pos], name, namesize);
+    pos += namesize;
+    if (end)
+        buf[pos++] = '>';
+
+    return pos;
+}
+
+static int write_attr(prefix_t *attrprefix, char *key, int keysize,
+                      char *value, int valsize, int sanitize,
+                      char *buf, int pos, int len)
+{
+    int size;
+
+    /* encode() checks the value itself; sanitizing may shrink it */
+    size = attrprefix ? strlen(attrprefix->prefix) + 1 : 0;
+    if ((keysize + size + 3) > (len - pos))
+        return SERIALIZE_FULL;
+
+    buf[pos++] = ' ';
+    if (attrprefix) {
+        memcpy(&buf[pos], attrprefix->prefix, size - 1);
+        pos += size - 1;
+        buf[pos++] = ':';
+    }
+    memcpy(&buf[pos], key, keysize);
+    pos += keysize;
+    buf[pos++] = '=';
+    buf[pos++] = '\'';
+    pos = encode(value, valsize, 1, sanitize, buf, pos, len);
+    if (pos < 0)
+        return pos;
+    if (1 > (len - pos))
+        return SERIALIZE_FULL;
+    buf[pos++] = '\'';
+
+    return pos;
+}
+
+/* write the default namespace and any prefixes the element declares */
+static int write_namespaces(char *defaultNS, char *defUri_s, char *uri_s,
+                            prefix_t *nameprefix, prefix_t *prefixes,
+                            char *buf, int pos, int len)
+{
+    prefix_t *prefix;
+    int size, total;
+
+    if (((defaultNS && defUri_s && strcmp(defaultNS, defUri_s) != 0) ||
+         (!defaultNS && defUri_s)) &&
+        uri_s && (strcmp(uri_s, defUri_s) != 0 ||
+                  !nameprefix || !nameprefix->in_scope)) {
+        size = strlen(defUri_s);
+        if ((size + 9) > (len - pos))
+            return SERIALIZE_FULL;
+        memcpy(&buf[pos], " xmlns='", 8);
+        pos += 8;
+        memcpy(&buf[pos], defUri_s, size);
+        pos += size;
+        buf[pos++] = '\'';
+    }
+
+    for (prefix = prefixes; prefix; prefix = prefix->next) {
+        if (prefix->needs_write && strcmp(prefix->prefix, "xml") != 0) {
+            /* the declaration goes out of scope when this element is
+             * popped, however deep the prefix was first created */
+            prefix->needs_write = 0;
+            prefix->in_scope = 1;
+            prefix->stack_height = 0;
+
+            size = strlen(prefix->prefix);
+            total = size + strlen(prefix->uri);
+            if ((total + 10) > len - pos)
+                return SERIALIZE_FULL;
+            memcpy(&buf[pos], " xmlns:", 7);
+            pos += 7;
+            memcpy(&buf[pos], prefix->prefix, size);
+            pos += size;
+            buf[pos++] = '=';
+            buf[pos++] = '\'';
+            memcpy(&buf[pos], prefix->uri, total - size);
+            pos += total - size;
+            buf[pos++] = '\'';
+        }
+    }
+
+    return pos;
+}
+
+static void push_prefixes(prefix_t *prefixes)
+{
+    prefix_t *prefix;
+
+    for (prefix = prefixes; prefix; prefix = prefix->next)
+        prefix->stack_height++;
+}
+
+static void pop_prefixes(prefix_t *prefixes)
+{
+    prefix_t *prefix;
+
+    for (prefix = prefixes; prefix; prefix = prefix->next) {
+        prefix->stack_height--;
+        if (prefix->stack_height == 0)
+            prefix->in_scope = 0;
+    }
+}
+
 static int do_serialize(PyObject *element,
                         char *defaultNS, prefix_t *prefixes,
-                        int closeElement, int *prefixCounter,
+                        int closeElement, int sanitize, int *prefixCounter,
                         char *buf, int pos, int len)
 {
     PyObject *o;
-    char *name, *s;
-    int size, total, namesize, i, ret, keysize, prefixsize, valsize, ok;
+    char *name;
+    int size, namesize, i, ret, ok, raw;
     PyObject *elemname, *attrs, *key, *value, *children, *child, *uri, *defUri,
         *class, *clsname;
-    PyObject *keyns, *keyname, *keyval, *localPrefs;
-    prefix_t *lprefixes, *found, *next;
+    PyObject *keyns, *keyname, *localPrefs;
+    prefix_t *lprefixes;
     Py_ssize_t dictpos = 0;
-    int uri_size = 0, defUri_size = 0;
-    prefix_t *prefix = NULL;
     prefix_t *nameprefix = NULL;
     prefix_t *attrprefix = NULL;
     char *defUri_s = NULL;
     char *uri_s = NULL;
 
-    ret = 0;
+    ret = SERIALIZE_FULL;
     uri = NULL;
     attrs = NULL;
     elemname = NULL;
@@ -258,30 +543,16 @@ static int do_serialize(PyObject *element,
             Py_INCREF(o);
         }
 
-        s = PyString_AS_STRING(o);
-        size = PyString_GET_SIZE(o);
-
         class = PyObject_GetAttrString(element, "__class__");
         clsname = PyObject_GetAttrString(class, "__name__");
-        if (strcmp("SerializedXML", PyString_AS_STRING(clsname)) == 0) {
-            if (size > len - pos + 1) {
-                Py_DECREF(clsname);
-                Py_DECREF(class);
-                Py_DECREF(o);
-                goto error;
-            }
-            strcpy(&buf[pos], s);
-            pos += size;
-        } else {
-            pos = encode(s, size, 0, buf, pos, len);
-        }
+        raw = strcmp("SerializedXML", PyString_AS_STRING(clsname)) == 0;
         Py_DECREF(clsname);
         Py_DECREF(class);
 
+        pos = write_content(PyString_AS_STRING(o), PyString_GET_SIZE(o),
+                            raw, sanitize, buf, pos, len);
         Py_DECREF(o);
 
-        if (!pos) goto error;
-
         return pos;
     }
 
@@ -291,25 +562,22 @@ static int do_serialize(PyObject *element,
     /* we have to handle these at the beginning because we may have to 
      * put a prefix on the element name */
     if (!PyObject_HasAttrString(element, "defaultUri")) {
-        ret = -1;
+        ret = SERIALIZE_BAD_TREE;
         goto error;
     }
 
     defUri = PyObject_GetAttrString(element, "defaultUri");
     if (defUri != Py_None && !PyString_Check(defUri) &&
         !PyUnicode_Check(defUri)) {
-        ret = -1;
+        ret = SERIALIZE_BAD_TREE;
         goto error;
     }
 
     if (PyString_Check(defUri) || PyUnicode_Check(defUri)) {
         defUri = make_utf8_string(defUri);
         defUri_s = PyString_AS_STRING(defUri);
-        defUri_size = PyString_GET_SIZE(defUri);
     } else {
         defUri_s = defaultNS;
-        if (defUri_s)
-            defUri_size = strlen(defUri_s);
     }
 
     /* prefixes */
@@ -321,74 +589,39 @@ static int do_serialize(PyObject *element,
         Py_DECREF(localPrefs);
         localPrefs = NULL;
         if (ok < 0) {
-            ret = -1;
+            ret = SERIALIZE_BAD_TREE;
             goto error;
         }
 
-        prefix = lprefixes;
-        while (prefix) {
-            next = prefix->next;
-            for (found = prefixes; found; found = found->next) {
-                if (strcmp(found->prefix, prefix->prefix) == 0)
-                    break;
-            }
-
-            if (!found) {
-                prefix_append(prefixes, prefix);
-            } else {
-                prefix_free(prefix);
-            }
-
-            prefix = next;
-        }
+        merge_local_prefixes(prefixes, lprefixes);
     }
 
     if (!PyObject_HasAttrString(element, "uri")) {
-        ret = -1;
+        ret = SERIALIZE_BAD_TREE;
         goto error;
     }
 
     uri = PyObject_GetAttrString(element, "uri");
     if (uri != Py_None && !PyString_Check(uri) && !PyUnicode_Check(uri)) {
-        ret = -1;
+        ret = SERIALIZE_BAD_TREE;
         goto error;
     }
 
     if (PyString_Check(uri) || PyUnicode_Check(uri)) {
         uri = make_utf8_string(uri);
         uri_s = PyString_AS_STRING(uri);
-        uri_size = PyString_GET_SIZE(uri);
-
-        for (prefix = prefixes; prefix; prefix = prefix->next) {
-            if (strcmp(prefix->uri, uri_s) == 0)
-                break;
-        }
 
-        if (defUri_s && strcmp(uri_s, defUri_s) != 0) {
-            prefix = prefix_find_uri(&prefixes, uri_s, prefixCounter);
-            if (!prefix->in_scope) {
-                prefix->needs_write = 1;
-                prefix->in_scope = 1;
-            }
-            nameprefix = prefix;
-        } else if (prefix) {
-            if (!prefix->in_scope) {
-                prefix->needs_write = 1;
-                prefix->in_scope = 1;
-            }
-            nameprefix = prefix;
-        }
+        nameprefix = resolve_name_prefix(prefixes, uri_s, defUri_s,
+                                         prefixCounter);
     } else {
         Py_DECREF(uri);
         uri = NULL;
 
         uri_s = defaultNS;
-        if (uri_s)
-            uri_size = strlen(defaultNS);
     }
 
     if (!PyObject_HasAttrString(element, "name")) {
-        ret = -1;
+        ret = SERIALIZE_BAD_TREE;
         goto error;
     }
 
@@ -396,43 +629,26 @@ static int do_serialize(PyObject *element,
     if (PyString_Check(elemname) || PyUnicode_Check(elemname)) {
         elemname = make_utf8_string(elemname);
     } else {
-        ret = -1;
+        ret = SERIALIZE_BAD_TREE;
         goto error;
     }
     
     name = PyString_AS_STRING(elemname);
     namesize = PyString_GET_SIZE(elemname);
 
-    if (nameprefix) {
-        size = strlen(nameprefix->prefix);
-        if ((namesize + size + 2) > (len - pos))
-            goto error;
-        
-        buf[pos++] = '<';
-        strcpy(&buf[pos], nameprefix->prefix);
-        pos += size;
-        buf[pos++] = ':';
-        strcpy(&buf[pos], name);
-        pos += namesize;
-    } else {
-        if (namesize + 1 > (len - pos))
-            goto error;
-
-        buf[pos++] = '<';
-        strcpy(&buf[pos], name);
-        pos += namesize;
-    }
-
+    pos = write_name(nameprefix, name, namesize, 0, buf, pos, len);
+    if (pos < 0)
+        goto error;
     
     /* attributes */
     if (!PyObject_HasAttrString(element, "attributes")) {
-        ret = -1;
+        ret = SERIALIZE_BAD_TREE;
         goto error;
     }
 
     attrs = PyObject_GetAttrString(element, "attributes");
     if (!PyDict_Check(attrs)) {
-        ret = -1;
+        ret = SERIALIZE_BAD_TREE;
         goto error;
     }
 
@@ -440,23 +656,22 @@ static int do_serialize(PyObject *element,
     while (PyDict_Next(attrs, &dictpos, &key, &value)) {
         attrprefix = NULL;
         keyname = NULL;
-        keyval = NULL;
         keyns = NULL;
 
         if (!PyString_Check(key) && !PyUnicode_Check(key) &&
             !PyTuple_Check(key)) {
-            ret = -1;
+            ret = SERIALIZE_BAD_TREE;
             goto error;
         }
 
         if (!PyString_Check(value) && !PyUnicode_Check(value)) {
-            ret = -1;
+            ret = SERIALIZE_BAD_TREE;
             goto error;
         }
         
         if (PyTuple_Check(key)) {
             if (PyTuple_GET_SIZE(key) != 2) {
-                ret = -1;
+                ret = SERIALIZE_BAD_TREE;
                 goto error;
             }
 
@@ -464,12 +679,12 @@ static int do_serialize(PyObject *element,
             keyname = PyTuple_GET_ITEM(key, 1);
 
             if (!PyString_Check(keyns) && !PyUnicode_Check(keyns)) {
-                ret = -1;
+                ret = SERIALIZE_BAD_TREE;
                 goto error;
             }
 
             if (!PyString_Check(keyname) && !PyUnicode_Check(keyname)) {
-                ret = -1;
+                ret = SERIALIZE_BAD_TREE;
                 goto error;
             }
 
@@ -481,9 +696,9 @@ static int do_serialize(PyObject *element,
             keyname = make_utf8_string(keyname);
             value = make_utf8_string(value);
 
-            attrprefix = prefix_find_uri(&prefixes, PyString_AS_STRING(keyns),
-                                         prefixCounter);
-            if (!attrprefix->in_scope) attrprefix->needs_write = 1;
+            attrprefix = resolve_attr_prefix(prefixes,
+                                             PyString_AS_STRING(keyns),
+                                             prefixCounter);
 
             if (keyns) {
                 Py_DECREF(keyns);
@@ -498,84 +713,25 @@ static int do_serialize(PyObject *element,
             value = make_utf8_string(value);
         }
 
-        keysize = PyString_GET_SIZE(keyname);
-        valsize = PyString_GET_SIZE(value);
-        if (!attrprefix) {
-            total = keysize + valsize;
-            if (total + 4 > (len - pos)) {
-                if (keyname) { Py_DECREF(keyname); }
-                if (value) { Py_DECREF(value); }
-                goto error;
-            }
-
-            buf[pos++] = ' ';
-            strcpy(&buf[pos], PyString_AS_STRING(keyname));
-            pos += keysize;
-        } else {
-            prefixsize = strlen(attrprefix->prefix);
-            total = keysize + valsize + prefixsize;
-            if ((total + 5) > (len - pos)) {
-                if (keyname) { Py_DECREF(keyname); }
-                if (value) { Py_DECREF(value); }
-                goto error;
-            }
-            buf[pos++] = ' ';
-            strcpy(&buf[pos], attrprefix->prefix);
-            pos += prefixsize;
-            buf[pos++] = ':';
-            strcpy(&buf[pos], PyString_AS_STRING(keyname));
-            pos += keysize;
-        }
-        buf[pos++] = '=';
-        buf[pos++] = '\'';
-        pos = encode(PyString_AS_STRING(value), valsize, 1,
-                     buf, pos, len);
-        if (!pos) {
-            if (keyname) { Py_DECREF(keyname); }
-            if (value) { Py_DECREF(value); }
-            goto error;
-        }
-        buf[pos++] = '\'';
+        pos = write_attr(attrprefix,
+                         PyString_AS_STRING(keyname),
+                         PyString_GET_SIZE(keyname),
+                         PyString_AS_STRING(value),
+                         PyString_GET_SIZE(value),
+                         sanitize, buf, pos, len);
 
         if (keyname) { Py_DECREF(keyname); }
         if (value) { Py_DECREF(value); }
-    }
 
-
-    /* write out namespaces and prefixes */
-    if (((defaultNS && defUri_s && strcmp(defaultNS, defUri_s) != 0) ||
-         (!defaultNS && defUri_s)) &&
-        uri_s && (strcmp(uri_s, defUri_s) != 0 ||
-                  !nameprefix || !nameprefix->in_scope)) {
-        if ((defUri_size + 9) > (len - pos))
+        if (pos < 0)
             goto error;
-        strcpy(&buf[pos], " xmlns='");
-        pos += 8;
-        strcpy(&buf[pos], defUri_s);
-        pos += defUri_size;
-        buf[pos++] = '\'';
     }
 
-    for (prefix = prefixes; prefix; prefix = prefix->next) {
-        if (prefix->needs_write && strcmp(prefix->prefix, "xml") != 0) {
-            prefix->needs_write = 0;
-            prefix->in_scope = 1;
-
-            size = strlen(prefix->prefix);
-            total = size + strlen(prefix->uri);
-            if ((total + 10) > len - pos)
-                goto error;
-            strcpy(&buf[pos], " xmlns:");
-            pos += 7;
-            strcpy(&buf[pos], prefix->prefix);
-            pos += size;
-            buf[pos++] = '=';
-            buf[pos++] = '\'';
-            strcpy(&buf[pos], prefix->uri);
-            pos += total - size;
-            buf[pos++] = '\'';
-        }
-    }
+    /* write out namespaces and prefixes */
+    pos = write_namespaces(defaultNS, defUri_s, uri_s, nameprefix, prefixes,
+                           buf, pos, len);
+    if (pos < 0)
+        goto error;
         
     /* short circuit if closeElement is false */
     if (!closeElement) {
@@ -590,19 +746,17 @@ static int do_serialize(PyObject *element,
 
     /* children */
     if (!PyObject_HasAttrString(element, "children")) {
-        ret = -1;
+        ret = SERIALIZE_BAD_TREE;
         goto error;
     }
 
     children = PyObject_GetAttrString(element, "children");
     if (!PyList_Check(children)) {
-        ret = -1;
+        ret = SERIALIZE_BAD_TREE;
         goto error;
     }
 
-    /* push prefixes onto the stack */
-    for (prefix = prefixes; prefix; prefix = prefix->next)
-        prefix->stack_height++;
+    push_prefixes(prefixes);
 
     size = PyList_GET_SIZE(children);
     if (size > 0) {
@@ -613,35 +767,17 @@ static int do_serialize(PyObject *element,
         for (i = 0; i < size; i++) {
             child = PyList_GET_ITEM(children, i);
             pos = do_serialize(child, defUri_s, prefixes,
-                               closeElement, prefixCounter,
+                               closeElement, sanitize, prefixCounter,
                                buf, pos, len);
-            if (!pos)
+            if (pos < 0) {
+                ret = pos;
                 goto error;
+            }
         }
 
-        if (nameprefix) {
-            size = strlen(nameprefix->prefix);
-            if ((namesize + size + 4) > (len - pos))
-                goto error;
-            
-            buf[pos++] = '<';
-            buf[pos++] = '/';
-            strcpy(&buf[pos], nameprefix->prefix);
-            pos += size;
-            buf[pos++] = ':';
-            strcpy(&buf[pos], name);
-            pos += namesize;
-            buf[pos++] = '>';
-        } else {
-            if (namesize + 3 > (len - pos))
-                goto error;
-
-            buf[pos++] = '<';
-            buf[pos++] = '/';
-            strcpy(&buf[pos], name);
-            pos += namesize;
-            buf[pos++] = '>';
-        }
+        pos = write_name(nameprefix, name, namesize, 1, buf, pos, len);
+        if (pos < 0)
+            goto error;
     } else {
         if (2 > (len - pos))
             goto error;
@@ -649,12 +785,7 @@ static int do_serialize(PyObject *element,
         buf[pos++] = '>';
     }
 
-    /* pop the prefix stack */
-    for (prefix = prefixes; prefix; prefix = prefix->next) {
-        prefix->stack_height--;
-        if (prefix->stack_height == 0)
-            prefix->in_scope = 0;
-    }
+    pop_prefixes(prefixes);
 
     ret =  pos;
     /* fall through */
@@ -669,59 +800,143 @@ error:
     return ret;
 }
 
-PyDoc_STRVAR(serialize__doc__,
-             "Serialize a domish element.");
+/* xxHash64 (seed 0) of the serialized bytes, for callers that
+ * deduplicate stanzas by content.  this is not a cryptographic hash.
+ */
+typedef unsigned PY_LONG_LONG u64_t;
 
-static PyObject *serialize(PyObject *self, PyObject *args, PyObject *kwargs)
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define XXH_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static u64_t xxh_read64(const unsigned char *p)
 {
-    int ok, size, i;
-    PyObject *element, *result, *value;
-    char buf[4096], *dynbuf;
-    prefix_t *found;
-    int len = 4096;
-    int closeElement = 1;
-    int prefixCounter = 0;
-    PyObject *prefixdict = NULL;
-    PyObject *defaultUri = NULL;
-    PyObject *prefixesInScope = NULL;
-    prefix_t *prefixes = NULL;
-    prefix_t *plist = NULL;
+    return (u64_t)p[0] | ((u64_t)p[1] << 8) | ((u64_t)p[2] << 16) |
+        ((u64_t)p[3] << 24) | ((u64_t)p[4] << 32) | ((u64_t)p[5] << 40) |
+        ((u64_t)p[6] << 48) | ((u64_t)p[7] << 56);
+}
 
-    static char *kwlist[] = {"element", "prefixes", "closeElement", 
-                             "defaultUri", "prefixesInScope", NULL};
+static u64_t xxh_read32(const unsigned char *p)
+{
+    return (u64_t)p[0] | ((u64_t)p[1] << 8) | ((u64_t)p[2] << 16) |
+        ((u64_t)p[3] << 24);
+}
 
-    ok = PyArg_ParseTupleAndKeywords(args, kwargs, "O|OiOO", kwlist,
-                                     &element, &prefixdict, &closeElement,
-                                     &defaultUri, &prefixesInScope);
-    if (!ok) {
-        PyErr_SetString(PyExc_TypeError,
-                        "serialize() takes exactly one or two arguments");
-        return NULL;
-    }
+static u64_t xxh_round(u64_t acc, u64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    acc = XXH_ROTL64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
 
-    prefixes = prefix_new();
-    if (!prefixes) {
-        PyErr_SetString(PyExc_RuntimeError,
-                        "memory allocation failed");
-        return NULL;
+static u64_t xxh_merge_round(u64_t acc, u64_t val)
+{
+    acc ^= xxh_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static u64_t xxhash64(const char *data, int size)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + size;
+    u64_t v1, v2, v3, v4, h;
+
+    if (size >= 32) {
+        v1 = XXH_PRIME64_1 + XXH_PRIME64_2;
+        v2 = XXH_PRIME64_2;
+        v3 = 0;
+        v4 = 0 - XXH_PRIME64_1;
+
+        do {
+            v1 = xxh_round(v1, xxh_read64(p));
+            v2 = xxh_round(v2, xxh_read64(p + 8));
+            v3 = xxh_round(v3, xxh_read64(p + 16));
+            v4 = xxh_round(v4, xxh_read64(p + 24));
+            p += 32;
+        } while (p <= end - 32);
+
+        h = XXH_ROTL64(v1, 1) + XXH_ROTL64(v2, 7) + XXH_ROTL64(v3, 12) +
+            XXH_ROTL64(v4, 18);
+        h = xxh_merge_round(h, v1);
+        h = xxh_merge_round(h, v2);
+        h = xxh_merge_round(h, v3);
+        h = xxh_merge_round(h, v4);
+    } else {
+        h = XXH_PRIME64_5;
     }
 
-    prefixes->uri = strdup("http://www.w3.org/XML/1998/namespace");
-    prefixes->prefix = strdup("xml");
-    prefixes->stack_height = 1;
+    h += (u64_t)size;
+
+    while (p + 8 <= end) {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = XXH_ROTL64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+
+    if (p + 4 <= end) {
+        h ^= xxh_read32(p) * XXH_PRIME64_1;
+        h = XXH_ROTL64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+
+    while (p < end) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = XXH_ROTL64(h, 11) * XXH_PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+static PyObject *SerializationLimitError;
+
+/* build the initial prefix list from the prefixes and prefixesInScope
+ * arguments.  returns -1 with an exception set on failure.
+ */
+static int build_prefixes(PyObject *prefixdict, PyObject *prefixesInScope,
+                          prefix_t **list)
+{
+    int ok, i;
+    PyObject *value;
+    prefix_t *found;
+    prefix_t *prefixes = NULL;
+    prefix_t *plist = NULL;
+
+    prefixes = prefix_new();
+    if (!prefixes) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "memory allocation failed");
+        return -1;
+    }
+
+    prefixes->uri = strdup("http://www.w3.org/XML/1998/namespace");
+    prefixes->prefix = strdup("xml");
+    prefixes->stack_height = 1;
 
     /* convert prefix dict to internal list structure */
-    plist = NULL;
     ok = convert_from_dict(prefixdict, &plist);
-    if (ok < 0) return NULL;
+    if (ok < 0) {
+        prefix_free_list(prefixes);
+        return -1;
+    }
     prefixes->next = plist;
 
     if (prefixesInScope) {
         if (prefixesInScope != Py_None && !PyList_Check(prefixesInScope)) {
             PyErr_SetString(PyExc_TypeError,
                             "Expected list or none for prefixesInScope.");
-            if (prefixes) prefix_free_list(prefixes);
-            return NULL;
+            prefix_free_list(prefixes);
+            return -1;
         }
         if (PyList_Check(prefixesInScope)) {
             for (i = 0; i < PyList_GET_SIZE(prefixesInScope); i++) {
@@ -729,8 +944,8 @@ static PyObject *serialize(PyObject *self, PyObject *args, PyObject *kwargs)
                 if (!PyString_Check(value) && !PyUnicode_Check(value)) {
                     PyErr_SetString(PyExc_TypeError,
                                     "Expected strings in prefixesInScope.");
-                    if (prefixes) prefix_free_list(prefixes);
-                    return NULL;
+                    prefix_free_list(prefixes);
+                    return -1;
                 }
 
                 Py_INCREF(value);
@@ -748,53 +963,2280 @@ static PyObject *serialize(PyObject *self, PyObject *args, PyObject *kwargs)
         }
     }
 
-    dynbuf = NULL;
-    size = do_serialize(element, NULL, prefixes, closeElement, 
-                        &prefixCounter, buf, 0, len);
-    while (size == 0) {
-        if (dynbuf)
-            free(dynbuf);
-        len *= 2;
-        dynbuf = (char *)malloc(len);
-        if (!dynbuf) {
-            if (prefixes) prefix_free_list(prefixes);
-            Py_RETURN_NONE;
-        }
-        size = do_serialize(element, NULL, prefixes, closeElement,
-                            &prefixCounter, 
-                            dynbuf, 0, len);
+    *list = prefixes;
+    return 0;
+}
+
+static int check_sanitize(int sanitize)
+{
+    if (sanitize != SANITIZE_NONE && sanitize != SANITIZE_DROP &&
+        sanitize != SANITIZE_REPLACE) {
+        PyErr_SetString(PyExc_ValueError,
+                        "sanitize must be SANITIZE_NONE, SANITIZE_DROP or "
+                        "SANITIZE_REPLACE");
+        return 0;
     }
+    return 1;
+}
 
-    if (prefixes) prefix_free_list(prefixes);
+/* serialize element into buf, or into a larger malloc'd buffer if buf
+ * is too small.  *out is set to whichever buffer holds the result and
+ * must be freed by the caller if it isn't buf.  the result is at most
+ * maxBytes long unless maxBytes is 0.  returns the size of the result,
+ * or -1 with an exception set.
+ */
+static int serialize_to_buffer(PyObject *element, PyObject *prefixdict,
+                               int closeElement, PyObject *prefixesInScope,
+                               int sanitize, int maxBytes,
+                               char *buf, int len, char **out)
+{
+    int size, limit;
+    int prefixCounter;
+    char *dynbuf = NULL;
+    prefix_t *prefixes;
+
+    *out = NULL;
+    size = SERIALIZE_FULL;
+    while (size == SERIALIZE_FULL) {
+        /* leave room for the terminator strcpy writes */
+        limit = len - 1;
+        if (maxBytes > 0 && limit > maxBytes)
+            limit = maxBytes;
+
+        /* a failed attempt leaves the prefix list in an unknown state,
+         * so every attempt starts from a fresh one */
+        if (build_prefixes(prefixdict, prefixesInScope, &prefixes) < 0) {
+            if (dynbuf) free(dynbuf);
+            return -1;
+        }
+
+        prefixCounter = 0;
+        size = do_serialize(element, NULL, prefixes, closeElement, sanitize,
+                            &prefixCounter, dynbuf ? dynbuf : buf, 0, limit);
+        prefix_free_list(prefixes);
+
+        if (size == SERIALIZE_FULL) {
+            if (limit == maxBytes) {
+                if (dynbuf) free(dynbuf);
+                PyErr_Format(SerializationLimitError,
+                             "serialized element exceeds %d bytes",
+                             maxBytes);
+                return -1;
+            }
+
+            if (dynbuf)
+                free(dynbuf);
+            len *= 2;
+            dynbuf = (char *)malloc(len);
+            if (!dynbuf) {
+                PyErr_SetString(PyExc_RuntimeError,
+                                "memory allocation failed");
+                return -1;
+            }
+        }
+    }
 
     if (size < 0) {
+        if (dynbuf) free(dynbuf);
         PyErr_SetString(PyExc_TypeError, "Incorrect object in element tree.");
-        return NULL;
+        return -1;
+    }
+
+    *out = dynbuf ? dynbuf : buf;
+    (*out)[size] = 0;
+    return size;
+}
+
+/* parallel serialization
+ *
+ * the children of a large root are serialized on native threads.  the
+ * workers can't touch python objects, so the tree is first copied into
+ * a snapshot of UTF-8 strings while we hold the GIL, and the workers
+ * serialize the snapshot with the GIL released.
+ *
+ * the output has to be the same as serializing the tree in one go.  the
+ * only state one child passes to the next is the prefixes it adds to
+ * the list, generated xnN ones and localPrefixes, so a planning pass
+ * over the snapshot records how long the list is and what the prefix
+ * counter is before each child.  a worker serializes each child with a
+ * copy of that much of the list and that counter, which gives the
+ * numbering of a sequential run whichever worker gets the child.
+ */
+
+#define PARALLEL_MIN_CHILDREN 64
+#define PARALLEL_MAX_WORKERS 64
+#define PARALLEL_CHUNKS_PER_WORKER 4
+
+typedef struct snode_st snode_t;
+
+typedef struct {
+    PyObject *ns;       /* NULL for unqualified attributes */
+    PyObject *name;
+    PyObject *value;
+} sattr_t;
+
+/* every PyObject here is a UTF-8 string, or NULL for None */
+struct snode_st {
+    PyObject *content;  /* set for content, everything else is unset */
+    int raw;
+    PyObject *name;
+    PyObject *uri;
+    PyObject *defUri;
+    prefix_t *lprefixes;
+    int nattrs;
+    sattr_t *attrs;
+    int nchildren;
+    snode_t *children;
+};
+
+static void snode_clear(snode_t *node)
+{
+    int i;
+
+    Py_XDECREF(node->content);
+    Py_XDECREF(node->name);
+    Py_XDECREF(node->uri);
+    Py_XDECREF(node->defUri);
+    prefix_free_list(node->lprefixes);
+
+    for (i = 0; i < node->nattrs; i++) {
+        Py_XDECREF(node->attrs[i].ns);
+        Py_XDECREF(node->attrs[i].name);
+        Py_XDECREF(node->attrs[i].value);
+    }
+    if (node->attrs) free(node->attrs);
+
+    for (i = 0; i < node->nchildren; i++)
+        snode_clear(&node->children[i]);
+    if (node->children) free(node->children);
+}
+
+/* new reference to a UTF-8 copy of a string attribute, NULL for None.
+ * returns -1 if the attribute is missing or of the wrong type.
+ */
+static int snapshot_string(PyObject *element, char *attr, int allowNone,
+                           PyObject **result)
+{
+    PyObject *o;
+
+    *result = NULL;
+    if (!PyObject_HasAttrString(element, attr))
+        return -1;
+
+    o = PyObject_GetAttrString(element, attr);
+    if (o == Py_None && allowNone) {
+        Py_DECREF(o);
+        return 0;
+    }
+    if (!PyString_Check(o) && !PyUnicode_Check(o)) {
+        Py_DECREF(o);
+        return -1;
+    }
+
+    *result = make_utf8_string(o);
+    return *result ? 0 : -1;
+}
+
+/* counts the snapshotted bytes that must reach the output, so an
+ * oversized tree is rejected while it is being copied rather than
+ * after.  escaping only adds bytes, and so does SANITIZE_REPLACE, but
+ * the characters SANITIZE_DROP removes are not counted.
+ */
+typedef struct {
+    int sanitize;
+    int maxBytes;       /* 0 for no limit */
+    int total;
+} sbudget_t;
+
+/* count s against the budget.  returns SERIALIZE_FULL once the total
+ * is over maxBytes.
+ */
+static int snapshot_count(sbudget_t *b, PyObject *s, int raw)
+{
+    const unsigned char *v;
+    int c, n, size;
+
+    if (b->maxBytes <= 0 || !s)
+        return 0;
+
+    v = (const unsigned char *)PyString_AS_STRING(s);
+    n = size = PyString_GET_SIZE(s);
+    if (b->sanitize == SANITIZE_DROP && !raw) {
+        for (c = 0; c < n; c++) {
+            if (sanitize_class[v[c]] == CLASS_CONTROL) {
+                size--;
+            } else if (sanitize_class[v[c]] == CLASS_LEAD &&
+                       ILLEGAL_SEQUENCE(v, c, n)) {
+                size -= 3;
+                c += 2;
+            }
+        }
+    }
+
+    if (size > b->maxBytes - b->total)
+        return SERIALIZE_FULL;
+    b->total += size;
+    return 0;
+}
+
+/* copy element into node, which must be zeroed.  returns
+ * SERIALIZE_BAD_TREE for anything do_serialize would reject, with an
+ * exception set if the failure was python's, or SERIALIZE_FULL when
+ * the budget runs out.  node must be cleared with snode_clear either
+ * way.
+ */
+static int snapshot(PyObject *element, snode_t *node, sbudget_t *budget)
+{
+    PyObject *o, *class, *clsname, *attrs, *children, *key, *value;
+    PyObject *localPrefs;
+    Py_ssize_t dictpos;
+    sattr_t *attr;
+    int i, ok;
+
+    /* handle content */
+    if (PyString_Check(element) || PyUnicode_Check(element)) {
+        class = PyObject_GetAttrString(element, "__class__");
+        clsname = PyObject_GetAttrString(class, "__name__");
+        node->raw = strcmp("SerializedXML", PyString_AS_STRING(clsname)) == 0;
+        Py_DECREF(clsname);
+        Py_DECREF(class);
+
+        Py_INCREF(element);
+        node->content = make_utf8_string(element);
+        if (!node->content)
+            return SERIALIZE_BAD_TREE;
+        return snapshot_count(budget, node->content, node->raw);
+    }
+
+    /* handle elements */
+    if (snapshot_string(element, "defaultUri", 1, &node->defUri) < 0 ||
+        snapshot_string(element, "uri", 1, &node->uri) < 0 ||
+        snapshot_string(element, "name", 0, &node->name) < 0)
+        return SERIALIZE_BAD_TREE;
+    if (snapshot_count(budget, node->name, 1) < 0)
+        return SERIALIZE_FULL;
+
+    if (PyObject_HasAttrString(element, "localPrefixes")) {
+        localPrefs = PyObject_GetAttrString(element, "localPrefixes");
+        ok = convert_from_dict(localPrefs, &node->lprefixes);
+        Py_DECREF(localPrefs);
+        if (ok < 0)
+            return SERIALIZE_BAD_TREE;
+    }
+
+    /* attributes */
+    if (!PyObject_HasAttrString(element, "attributes"))
+        return SERIALIZE_BAD_TREE;
+    attrs = PyObject_GetAttrString(element, "attributes");
+    if (!PyDict_Check(attrs)) {
+        Py_DECREF(attrs);
+        return SERIALIZE_BAD_TREE;
+    }
+
+    node->attrs = (sattr_t *)calloc(PyDict_Size(attrs) + 1, sizeof(sattr_t));
+    if (!node->attrs) {
+        Py_DECREF(attrs);
+        PyErr_NoMemory();
+        return SERIALIZE_BAD_TREE;
+    }
+
+    dictpos = 0;
+    while (PyDict_Next(attrs, &dictpos, &key, &value)) {
+        attr = &node->attrs[node->nattrs++];
+
+        if (PyTuple_Check(key) && PyTuple_GET_SIZE(key) == 2) {
+            attr->ns = PyTuple_GET_ITEM(key, 0);
+            attr->name = PyTuple_GET_ITEM(key, 1);
+        } else {
+            attr->name = key;
+        }
+
+        if ((attr->ns &&
+             !PyString_Check(attr->ns) && !PyUnicode_Check(attr->ns)) ||
+            (!PyString_Check(attr->name) && !PyUnicode_Check(attr->name)) ||
+            (!PyString_Check(value) && !PyUnicode_Check(value))) {
+            attr->ns = attr->name = NULL;
+            Py_DECREF(attrs);
+            return SERIALIZE_BAD_TREE;
+        }
+
+        /* turn borrowed refs into new refs */
+        Py_XINCREF(attr->ns);
+        Py_INCREF(attr->name);
+        Py_INCREF(value);
+        if (attr->ns)
+            attr->ns = make_utf8_string(attr->ns);
+        attr->name = make_utf8_string(attr->name);
+        attr->value = make_utf8_string(value);
+        if (!attr->name || !attr->value) {
+            Py_DECREF(attrs);
+            return SERIALIZE_BAD_TREE;
+        }
+        if (snapshot_count(budget, attr->name, 1) < 0 ||
+            snapshot_count(budget, attr->value, 0) < 0) {
+            Py_DECREF(attrs);
+            return SERIALIZE_FULL;
+        }
+    }
+    Py_DECREF(attrs);
+
+    /* children */
+    if (!PyObject_HasAttrString(element, "children"))
+        return SERIALIZE_BAD_TREE;
+    children = PyObject_GetAttrString(element, "children");
+    if (!PyList_Check(children)) {
+        Py_DECREF(children);
+        return SERIALIZE_BAD_TREE;
+    }
+
+    node->children = (snode_t *)calloc(PyList_GET_SIZE(children) + 1,
+                                       sizeof(snode_t));
+    if (!node->children) {
+        Py_DECREF(children);
+        PyErr_NoMemory();
+        return SERIALIZE_BAD_TREE;
     }
 
-    if (dynbuf) {
-        dynbuf[size] = 0;
-        result = PyUnicode_DecodeUTF8(dynbuf, size, NULL);
-        free(dynbuf);
+    for (i = 0; i < PyList_GET_SIZE(children); i++) {
+        o = PyList_GET_ITEM(children, i);
+        node->nchildren++;
+        ok = snapshot(o, &node->children[i], budget);
+        if (ok < 0) {
+            Py_DECREF(children);
+            return ok;
+        }
+    }
+    Py_DECREF(children);
+
+    return 0;
+}
+
+static prefix_t *prefix_copy_list(prefix_t *list, int count)
+{
+    prefix_t *head = NULL;
+    prefix_t *tail = NULL;
+    prefix_t *item;
+
+    for (; list && count > 0; list = list->next, count--) {
+        item = prefix_new();
+        if (!item) {
+            prefix_free_list(head);
+            return NULL;
+        }
+        item->uri = strdup(list->uri);
+        item->prefix = strdup(list->prefix);
+        item->in_scope = list->in_scope;
+        item->stack_height = list->stack_height;
+        item->needs_write = list->needs_write;
+
+        if (tail)
+            tail->next = item;
+        else
+            head = item;
+        tail = item;
+    }
+
+    return head;
+}
+
+static int prefix_count(prefix_t *list)
+{
+    int count;
+
+    for (count = 0; list; list = list->next)
+        count++;
+    return count;
+}
+
+/* write the start tag of an element snapshot up to the closing '>',
+ * the same way do_serialize does.  *defUri_s and *nameprefix are set
+ * for writing the children and the end tag.
+ */
+static int emit_start(snode_t *node, char *defaultNS, prefix_t *prefixes,
+                      int sanitize, int *prefixCounter,
+                      char **defUri_s, prefix_t **nameprefix,
+                      char *buf, int pos, int len)
+{
+    sattr_t *attr;
+    prefix_t *attrprefix;
+    char *uri_s;
+    int i;
+
+    *defUri_s = node->defUri ? PyString_AS_STRING(node->defUri) : defaultNS;
+
+    if (node->lprefixes)
+        merge_local_prefixes(prefixes, prefix_copy_list(node->lprefixes,
+                                                        INT_MAX));
+
+    *nameprefix = NULL;
+    if (node->uri) {
+        uri_s = PyString_AS_STRING(node->uri);
+        *nameprefix = resolve_name_prefix(prefixes, uri_s, *defUri_s,
+                                          prefixCounter);
     } else {
-        buf[size] = 0;
-        result = PyUnicode_DecodeUTF8(buf, size, NULL);
+        uri_s = defaultNS;
     }
 
-    return result;
+    pos = write_name(*nameprefix, PyString_AS_STRING(node->name),
+                     PyString_GET_SIZE(node->name), 0, buf, pos, len);
+
+    for (i = 0; i < node->nattrs && pos >= 0; i++) {
+        attr = &node->attrs[i];
+        attrprefix = NULL;
+        if (attr->ns)
+            attrprefix = resolve_attr_prefix(prefixes,
+                                             PyString_AS_STRING(attr->ns),
+                                             prefixCounter);
+        pos = write_attr(attrprefix,
+                         PyString_AS_STRING(attr->name),
+                         PyString_GET_SIZE(attr->name),
+                         PyString_AS_STRING(attr->value),
+                         PyString_GET_SIZE(attr->value),
+                         sanitize, buf, pos, len);
+    }
+
+    if (pos >= 0)
+        pos = write_namespaces(defaultNS, *defUri_s, uri_s, *nameprefix,
+                               prefixes, buf, pos, len);
+
+    return pos;
 }
 
-static PyMethodDef cserialize_methods[] = {
-    {"serialize", (PyCFunction)serialize, 
-     METH_VARARGS | METH_KEYWORDS, serialize__doc__},
-    {NULL, NULL}
-};
+/* do_serialize for a snapshot.  needs no GIL. */
+static int emit_node(snode_t *node, char *defaultNS, prefix_t *prefixes,
+                     int sanitize, int *prefixCounter,
+                     char *buf, int pos, int len)
+{
+    prefix_t *nameprefix;
+    char *defUri_s;
+    int i;
+
+    if (node->content)
+        return write_content(PyString_AS_STRING(node->content),
+                             PyString_GET_SIZE(node->content),
+                             node->raw, sanitize, buf, pos, len);
+
+    pos = emit_start(node, defaultNS, prefixes, sanitize, prefixCounter,
+                     &defUri_s, &nameprefix, buf, pos, len);
+    if (pos < 0)
+        return pos;
 
+    push_prefixes(prefixes);
 
-PyDoc_STRVAR(cserialize__doc__,
-             "Domish XML serializer in C.");
+    if (node->nchildren > 0) {
+        if (1 > (len - pos))
+            return SERIALIZE_FULL;
+        buf[pos++] = '>';
 
-PyMODINIT_FUNC initcserialize(void)
+        for (i = 0; i < node->nchildren; i++) {
+            pos = emit_node(&node->children[i], defUri_s, prefixes,
+                            sanitize, prefixCounter, buf, pos, len);
+            if (pos < 0)
+                return pos;
+        }
+
+        pos = write_name(nameprefix, PyString_AS_STRING(node->name),
+                         PyString_GET_SIZE(node->name), 1, buf, pos, len);
+        if (pos < 0)
+            return pos;
+    } else {
+        if (2 > (len - pos))
+            return SERIALIZE_FULL;
+        buf[pos++] = '/';
+        buf[pos++] = '>';
+    }
+
+    pop_prefixes(prefixes);
+
+    return pos;
+}
+
+/* make the prefix list changes emit_node would make, without writing
+ * anything.
+ */
+static void plan_node(snode_t *node, char *defaultNS, prefix_t *prefixes,
+                      int *prefixCounter)
+{
+    char *defUri_s;
+    int i;
+
+    if (node->content)
+        return;
+
+    defUri_s = node->defUri ? PyString_AS_STRING(node->defUri) : defaultNS;
+
+    if (node->lprefixes)
+        merge_local_prefixes(prefixes, prefix_copy_list(node->lprefixes,
+                                                        INT_MAX));
+
+    if (node->uri && defUri_s &&
+        strcmp(PyString_AS_STRING(node->uri), defUri_s) != 0)
+        prefix_find_uri(&prefixes, PyString_AS_STRING(node->uri),
+                        prefixCounter);
+
+    for (i = 0; i < node->nattrs; i++) {
+        if (node->attrs[i].ns)
+            prefix_find_uri(&prefixes, PyString_AS_STRING(node->attrs[i].ns),
+                            prefixCounter);
+    }
+
+    for (i = 0; i < node->nchildren; i++)
+        plan_node(&node->children[i], defUri_s, prefixes, prefixCounter);
+}
+
+/* chunk status when a worker ran out of memory */
+#define CHUNK_NO_MEMORY -3
+
+typedef struct {
+    int first;          /* children [first, last) */
+    int last;
+    char *buf;
+    int size;
+    int status;         /* 0, SERIALIZE_FULL or CHUNK_NO_MEMORY */
+} chunk_t;
+
+typedef struct {
+    snode_t *root;
+    char *defaultNS;
+    prefix_t *prefixes;
+    int *list_len;      /* prefix list length before each child */
+    int *counters;      /* prefix counter before each child */
+    int sanitize;
+    int maxBytes;
+    int used;           /* bytes finished so far, counted against maxBytes */
+    chunk_t *chunks;
+    int nchunks;
+    int next;
+    volatile int failed;
+    pthread_mutex_t lock;
+} parallel_t;
+
+/* bytes a worker may still write before the output passes maxBytes */
+static int parallel_left(parallel_t *p)
+{
+    int left;
+
+    pthread_mutex_lock(&p->lock);
+    left = p->maxBytes - p->used;
+    pthread_mutex_unlock(&p->lock);
+
+    return left;
+}
+
+/* count size more finished bytes against maxBytes.  returns -1, and
+ * stops every worker, once the total is over.
+ */
+static int parallel_claim(parallel_t *p, int size)
+{
+    int over;
+
+    pthread_mutex_lock(&p->lock);
+    p->used += size;
+    over = p->used > p->maxBytes;
+    if (over)
+        p->failed = 1;
+    pthread_mutex_unlock(&p->lock);
+
+    return over ? -1 : 0;
+}
+
+static int serialize_chunk(parallel_t *p, chunk_t *chunk)
+{
+    prefix_t *prefixes;
+    int i, pos, len, end, limit, counter;
+    char *buf;
+
+    len = 4096;
+    end = INT_MAX;
+    if (p->maxBytes > 0) {
+        end = parallel_left(p);
+        if (end < len)
+            len = end > 0 ? end + 1 : 1;
+    }
+    chunk->buf = (char *)malloc(len);
+    if (!chunk->buf)
+        return CHUNK_NO_MEMORY;
+
+    pos = 0;
+    for (i = chunk->first; i < chunk->last; i++) {
+        if (p->failed)
+            return 0;
+
+        for (;;) {
+            /* this child may use what is left of maxBytes, no more */
+            limit = len - 1;
+            if (p->maxBytes > 0) {
+                end = pos + parallel_left(p);
+                if (limit > end)
+                    limit = end;
+            }
+
+            prefixes = prefix_copy_list(p->prefixes, p->list_len[i]);
+            if (!prefixes)
+                return CHUNK_NO_MEMORY;
+            counter = p->counters[i];
+            chunk->size = emit_node(&p->root->children[i], p->defaultNS,
+                                    prefixes, p->sanitize, &counter,
+                                    chunk->buf, pos, limit);
+            prefix_free_list(prefixes);
+            if (chunk->size >= 0)
+                break;
+
+            /* grow the buffer and redo this child */
+            if (p->maxBytes > 0 && limit >= end) {
+                p->failed = 1;
+                return SERIALIZE_FULL;
+            }
+            if (len > INT_MAX / 2)
+                return CHUNK_NO_MEMORY;
+            len *= 2;
+            if (p->maxBytes > 0 && len - 1 > end)
+                len = end + 1;
+            buf = (char *)realloc(chunk->buf, len);
+            if (!buf)
+                return CHUNK_NO_MEMORY;
+            chunk->buf = buf;
+        }
+
+        if (p->maxBytes > 0 && parallel_claim(p, chunk->size - pos) < 0)
+            return SERIALIZE_FULL;
+        pos = chunk->size;
+    }
+    chunk->size = pos;
+
+    return 0;
+}
+
+static void *parallel_worker(void *arg)
+{
+    parallel_t *p = (parallel_t *)arg;
+    chunk_t *chunk;
+
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        chunk = NULL;
+        if (!p->failed && p->next < p->nchunks)
+            chunk = &p->chunks[p->next++];
+        pthread_mutex_unlock(&p->lock);
+
+        if (!chunk)
+            break;
+
+        chunk->status = serialize_chunk(p, chunk);
+        if (chunk->status < 0)
+            p->failed = 1;
+    }
+
+    return NULL;
+}
+
+/* serialize_to_buffer, splitting the root's children over workers
+ * threads.  elements with too few children to be worth it are handed
+ * to serialize_to_buffer.
+ */
+static int serialize_parallel(PyObject *element, PyObject *prefixdict,
+                              int closeElement, PyObject *prefixesInScope,
+                              int sanitize, int maxBytes, int workers,
+                              char *buf, int len, char **out)
 {
-    Py_InitModule3("cserialize", cserialize_methods, cserialize__doc__);
+    snode_t root;
+    parallel_t p;
+    pthread_t threads[PARALLEL_MAX_WORKERS];
+    prefix_t *prefixes = NULL;
+    prefix_t *nameprefix;
+    char *defUri_s, *joined;
+    char *result = NULL;
+    int i, pos, size, count, started, counter, status, closing, limit;
+    sbudget_t budget;
+    PyObject *children;
+
+    *out = NULL;
+    if (workers > PARALLEL_MAX_WORKERS)
+        workers = PARALLEL_MAX_WORKERS;
+
+    count = 0;
+    if (closeElement && workers > 1 &&
+        !PyString_Check(element) && !PyUnicode_Check(element) &&
+        PyObject_HasAttrString(element, "children")) {
+        children = PyObject_GetAttrString(element, "children");
+        if (PyList_Check(children))
+            count = PyList_GET_SIZE(children);
+        Py_DECREF(children);
+    }
+    if (count < PARALLEL_MIN_CHILDREN)
+        return serialize_to_buffer(element, prefixdict, closeElement,
+                                   prefixesInScope, sanitize, maxBytes,
+                                   buf, len, out);
+
+    memset(&root, 0, sizeof(root));
+    memset(&p, 0, sizeof(p));
+    status = 0;
+
+    budget.sanitize = sanitize;
+    budget.maxBytes = maxBytes;
+    budget.total = 0;
+    status = snapshot(element, &root, &budget);
+    if (status == SERIALIZE_FULL) {
+        snode_clear(&root);
+        PyErr_Format(SerializationLimitError,
+                     "serialized element exceeds %d bytes", maxBytes);
+        return -1;
+    }
+    if (status < 0 || root.content) {
+        snode_clear(&root);
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_TypeError,
+                            "Incorrect object in element tree.");
+        return -1;
+    }
+
+    /* the root's start tag, retried with a fresh prefix list if buf
+     * is too small */
+    for (;;) {
+        if (build_prefixes(prefixdict, prefixesInScope, &prefixes) < 0) {
+            status = -1;
+            goto done;
+        }
+        limit = len - 1;
+        if (maxBytes > 0 && limit > maxBytes)
+            limit = maxBytes;
+        counter = 0;
+        pos = emit_start(&root, NULL, prefixes, sanitize, &counter,
+                         &defUri_s, &nameprefix, buf, 0, limit);
+        if (pos >= 0)
+            break;
+
+        prefix_free_list(prefixes);
+        prefixes = NULL;
+        if (limit == maxBytes) {
+            PyErr_Format(SerializationLimitError,
+                         "serialized element exceeds %d bytes", maxBytes);
+            status = -1;
+            goto done;
+        }
+        if (len > INT_MAX / 2) {
+            PyErr_SetString(PyExc_RuntimeError, "memory allocation failed");
+            status = -1;
+            goto done;
+        }
+        if (result) free(result);
+        len *= 2;
+        buf = result = (char *)malloc(len);
+        if (!result) {
+            PyErr_SetString(PyExc_RuntimeError, "memory allocation failed");
+            status = -1;
+            goto done;
+        }
+    }
+    push_prefixes(prefixes);
+
+    /* plan the prefix list for each child */
+    p.list_len = (int *)malloc(root.nchildren * sizeof(int));
+    p.counters = (int *)malloc(root.nchildren * sizeof(int));
+    p.nchunks = workers * PARALLEL_CHUNKS_PER_WORKER;
+    if (p.nchunks > root.nchildren)
+        p.nchunks = root.nchildren;
+    p.chunks = (chunk_t *)calloc(p.nchunks, sizeof(chunk_t));
+    if (!p.list_len || !p.counters || !p.chunks) {
+        PyErr_SetString(PyExc_RuntimeError, "memory allocation failed");
+        status = -1;
+        goto done;
+    }
+
+    size = prefix_count(prefixes);
+    for (i = 0; i < root.nchildren; i++) {
+        p.list_len[i] = size;
+        p.counters[i] = counter;
+        plan_node(&root.children[i], defUri_s, prefixes, &counter);
+        size = prefix_count(prefixes);
+    }
+
+    for (i = 0; i < p.nchunks; i++) {
+        p.chunks[i].first = (int)((long)root.nchildren * i / p.nchunks);
+        p.chunks[i].last = (int)((long)root.nchildren * (i + 1) / p.nchunks);
+    }
+
+    p.root = &root;
+    p.defaultNS = defUri_s;
+    p.prefixes = prefixes;
+    p.sanitize = sanitize;
+    p.maxBytes = maxBytes;
+
+    /* the start tag and the closing tag count against maxBytes before
+     * any child does */
+    closing = PyString_GET_SIZE(root.name) + 3 +
+        (nameprefix ? strlen(nameprefix->prefix) + 1 : 0);
+    p.used = pos + 1 + closing;
+    if (maxBytes > 0 && p.used > maxBytes) {
+        PyErr_Format(SerializationLimitError,
+                     "serialized element exceeds %d bytes", maxBytes);
+        status = -1;
+        goto done;
+    }
+    pthread_mutex_init(&p.lock, NULL);
+
+    /* this thread is one of the workers */
+    Py_BEGIN_ALLOW_THREADS
+    for (started = 0; started < workers - 1; started++) {
+        if (pthread_create(&threads[started], NULL, parallel_worker, &p))
+            break;
+    }
+    parallel_worker(&p);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    Py_END_ALLOW_THREADS
+
+    pthread_mutex_destroy(&p.lock);
+
+    /* join the pieces */
+    size = pos + 1;
+    for (i = 0; i < p.nchunks; i++) {
+        if (p.chunks[i].status == CHUNK_NO_MEMORY) {
+            PyErr_SetString(PyExc_RuntimeError, "memory allocation failed");
+            status = -1;
+            goto done;
+        }
+        if (p.chunks[i].status == SERIALIZE_FULL) {
+            size = INT_MAX;
+            break;
+        }
+        size += p.chunks[i].size;
+    }
+    if (size != INT_MAX)
+        size += closing;
+
+    if (maxBytes > 0 && size > maxBytes) {
+        PyErr_Format(SerializationLimitError,
+                     "serialized element exceeds %d bytes", maxBytes);
+        status = -1;
+        goto done;
+    }
+
+    joined = (char *)malloc(size + 1);
+    if (!joined) {
+        PyErr_SetString(PyExc_RuntimeError, "memory allocation failed");
+        status = -1;
+        goto done;
+    }
+
+    memcpy(joined, buf, pos);
+    joined[pos++] = '>';
+    for (i = 0; i < p.nchunks; i++) {
+        memcpy(&joined[pos], p.chunks[i].buf, p.chunks[i].size);
+        pos += p.chunks[i].size;
+    }
+    pos = write_name(nameprefix, PyString_AS_STRING(root.name),
+                     PyString_GET_SIZE(root.name), 1, joined, pos, size);
+    joined[pos] = 0;
+
+    *out = joined;
+    status = pos;
+
+done:
+    if (result) free(result);
+    if (prefixes) prefix_free_list(prefixes);
+    if (p.chunks) {
+        for (i = 0; i < p.nchunks; i++)
+            if (p.chunks[i].buf) free(p.chunks[i].buf);
+        free(p.chunks);
+    }
+    if (p.list_len) free(p.list_len);
+    if (p.counters) free(p.counters);
+    snode_clear(&root);
+
+    return status;
+}
+
+PyDoc_STRVAR(serialize__doc__,
+             "Serialize a domish element.\n\n"
+             "If maxBytes is given, serialization stops as soon as the UTF-8\n"
+             "output would exceed that many bytes and SerializationLimitError\n"
+             "is raised.\n\n"
+             "If withHash is true, a tuple of the result and the xxHash64 of\n"
+             "its UTF-8 encoding is returned instead.\n\n"
+             "sanitize controls characters that are not allowed in XML 1.0\n"
+             "found in content and attribute values.  SANITIZE_NONE passes\n"
+             "them through, SANITIZE_DROP removes them and SANITIZE_REPLACE\n"
+             "substitutes U+FFFD.\n\n"
+             "If workers is more than 1 and the element has many children,\n"
+             "the children are serialized on that many native threads.  The\n"
+             "result is the same as without workers.");
+
+static PyObject *serialize(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    int ok, size;
+    PyObject *element, *result;
+    char buf[4096], *out;
+    u64_t hash = 0;
+    int closeElement = 1;
+    int maxBytes = 0;
+    int withHash = 0;
+    int sanitize = SANITIZE_NONE;
+    int workers = 1;
+    PyObject *prefixdict = NULL;
+    PyObject *defaultUri = NULL;
+    PyObject *prefixesInScope = NULL;
+
+    static char *kwlist[] = {"element", "prefixes", "closeElement", 
+                             "defaultUri", "prefixesInScope", "maxBytes",
+                             "withHash", "sanitize", "workers", NULL};
+
+    ok = PyArg_ParseTupleAndKeywords(args, kwargs, "O|OiOOiiii", kwlist,
+                                     &element, &prefixdict, &closeElement,
+                                     &defaultUri, &prefixesInScope,
+                                     &maxBytes, &withHash, &sanitize,
+                                     &workers);
+    if (!ok) {
+        PyErr_SetString(PyExc_TypeError,
+                        "serialize() takes exactly one or two arguments");
+        return NULL;
+    }
+
+    if (!check_sanitize(sanitize))
+        return NULL;
+
+    size = serialize_parallel(element, prefixdict, closeElement,
+                              prefixesInScope, sanitize, maxBytes, workers,
+                              buf, sizeof(buf), &out);
+    if (size < 0)
+        return NULL;
+
+    /* hash the bytes while they are still hot in the cache, before
+     * they are decoded */
+    if (withHash)
+        hash = xxhash64(out, size);
+
+    result = PyUnicode_DecodeUTF8(out, size, NULL);
+    if (out != buf)
+        free(out);
+
+    if (result && withHash)
+        result = Py_BuildValue("(NK)", result, hash);
+
+    return result;
+}
+
+/* compact binary encoding
+ *
+ * this is meant for links between our own nodes, where producing XML
+ * text only to parse it again on the other side is wasted work.  names
+ * and namespace URIs are stored once in a string table and referenced
+ * by index; content is stored verbatim with no escaping.  all integers
+ * are 32 bit little endian.
+ *
+ *   "CSB1"                      magic
+ *   u32 total                   length of the whole message
+ *   u32 count                   string table, count entries of
+ *       u32 size, bytes
+ *   node                        the root node, one of
+ *       'T' u32 size, bytes     text content
+ *       'R' u32 size, bytes     raw xml (SerializedXML)
+ *       'E' u32 uri, u32 name, u32 defaultUri
+ *           u32 count           attributes, count entries of
+ *               u32 ns, u32 name, u32 size, bytes
+ *           u32 count           localPrefixes, count entries of
+ *               u32 key, u32 value
+ *           u32 count           children, count nodes
+ *
+ * string references are indexes into the table, or NO_STRING for None.
+ */
+
+#define BINARY_MAGIC "CSB1"
+#define BINARY_HEADER_SIZE 12
+#define NO_STRING 0xffffffffU
+
+typedef struct {
+    char *data;
+    int pos;
+    int len;
+} binbuf_t;
+
+typedef struct {
+    PyObject *index;    /* utf8 string -> table position */
+    binbuf_t table;
+    unsigned int count;
+} strtab_t;
+
+static int binbuf_reserve(binbuf_t *b, int size)
+{
+    char *data;
+    int len;
+
+    if (size <= b->len - b->pos)
+        return 1;
+
+    len = b->len ? b->len : 4096;
+    while (size > len - b->pos)
+        len *= 2;
+
+    data = (char *)realloc(b->data, len);
+    if (!data)
+        return 0;
+
+    b->data = data;
+    b->len = len;
+    return 1;
+}
+
+static void put_u32(char *p, unsigned int v)
+{
+    p[0] = (char)(v & 0xff);
+    p[1] = (char)((v >> 8) & 0xff);
+    p[2] = (char)((v >> 16) & 0xff);
+    p[3] = (char)((v >> 24) & 0xff);
+}
+
+static unsigned int get_u32(const unsigned char *p)
+{
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8) |
+        ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static int binbuf_write_u32(binbuf_t *b, unsigned int v)
+{
+    if (!binbuf_reserve(b, 4))
+        return 0;
+    put_u32(&b->data[b->pos], v);
+    b->pos += 4;
+    return 1;
+}
+
+static int binbuf_write_bytes(binbuf_t *b, char *s, int size)
+{
+    if (!binbuf_write_u32(b, (unsigned int)size))
+        return 0;
+    if (!binbuf_reserve(b, size))
+        return 0;
+    memcpy(&b->data[b->pos], s, size);
+    b->pos += size;
+    return 1;
+}
+
+/* look up a name or uri in the string table, adding it if it is new.
+ * None maps to NO_STRING.  returns -1 for bad objects, 0 for out of
+ * memory and 1 on success.
+ */
+static int strtab_intern(strtab_t *t, PyObject *s, unsigned int *idx)
+{
+    PyObject *found, *num;
+    int ok;
+
+    if (s == Py_None) {
+        *idx = NO_STRING;
+        return 1;
+    }
+
+    if (!PyString_Check(s) && !PyUnicode_Check(s))
+        return -1;
+
+    Py_INCREF(s);
+    s = make_utf8_string(s);
+    if (!s) return 0;
+
+    found = PyDict_GetItem(t->index, s);
+    if (found) {
+        *idx = (unsigned int)PyInt_AS_LONG(found);
+        Py_DECREF(s);
+        return 1;
+    }
+
+    num = PyInt_FromLong((long)t->count);
+    ok = num && PyDict_SetItem(t->index, s, num) == 0 &&
+        binbuf_write_bytes(&t->table, PyString_AS_STRING(s),
+                           PyString_GET_SIZE(s));
+    Py_XDECREF(num);
+    Py_DECREF(s);
+    if (!ok) return 0;
+
+    *idx = t->count++;
+    return 1;
+}
+
+/* same return convention as strtab_intern */
+static int write_binary_string_ref(binbuf_t *b, strtab_t *t, PyObject *s)
+{
+    unsigned int idx;
+    int ok;
+
+    ok = strtab_intern(t, s, &idx);
+    if (ok <= 0) return ok;
+
+    return binbuf_write_u32(b, idx);
+}
+
+static int do_serialize_binary(PyObject *element, strtab_t *t, binbuf_t *b)
+{
+    PyObject *o, *class, *clsname, *key, *value, *keyns, *keyname;
+    PyObject *uri, *name, *defUri, *attrs, *localPrefs, *children;
+    Py_ssize_t dictpos;
+    char tag;
+    int i, size, ret;
+
+    /* handle content */
+    if (PyString_Check(element) || PyUnicode_Check(element)) {
+        class = PyObject_GetAttrString(element, "__class__");
+        clsname = PyObject_GetAttrString(class, "__name__");
+        if (strcmp("SerializedXML", PyString_AS_STRING(clsname)) == 0)
+            tag = 'R';
+        else
+            tag = 'T';
+        Py_DECREF(clsname);
+        Py_DECREF(class);
+
+        Py_INCREF(element);
+        o = make_utf8_string(element);
+        if (!o) return 0;
+
+        ret = binbuf_reserve(b, 1);
+        if (ret) {
+            b->data[b->pos++] = tag;
+            ret = binbuf_write_bytes(b, PyString_AS_STRING(o),
+                                     PyString_GET_SIZE(o));
+        }
+        Py_DECREF(o);
+
+        return ret;
+    }
+
+    /* handle elements */
+    if (!PyObject_HasAttrString(element, "uri") ||
+        !PyObject_HasAttrString(element, "name") ||
+        !PyObject_HasAttrString(element, "defaultUri") ||
+        !PyObject_HasAttrString(element, "attributes") ||
+        !PyObject_HasAttrString(element, "children"))
+        return -1;
+
+    uri = PyObject_GetAttrString(element, "uri");
+    name = PyObject_GetAttrString(element, "name");
+    defUri = PyObject_GetAttrString(element, "defaultUri");
+    attrs = PyObject_GetAttrString(element, "attributes");
+    children = PyObject_GetAttrString(element, "children");
+    localPrefs = NULL;
+    if (PyObject_HasAttrString(element, "localPrefixes"))
+        localPrefs = PyObject_GetAttrString(element, "localPrefixes");
+
+    ret = -1;
+    if (name == Py_None || !PyDict_Check(attrs) || !PyList_Check(children))
+        goto error;
+    if (localPrefs && localPrefs != Py_None && !PyDict_Check(localPrefs))
+        goto error;
+
+    ret = 0;
+    if (!binbuf_reserve(b, 1))
+        goto error;
+    b->data[b->pos++] = 'E';
+
+    if ((ret = write_binary_string_ref(b, t, uri)) <= 0 ||
+        (ret = write_binary_string_ref(b, t, name)) <= 0 ||
+        (ret = write_binary_string_ref(b, t, defUri)) <= 0)
+        goto error;
+
+    /* attributes */
+    ret = 0;
+    if (!binbuf_write_u32(b, (unsigned int)PyDict_Size(attrs)))
+        goto error;
+
+    dictpos = 0;
+    while (PyDict_Next(attrs, &dictpos, &key, &value)) {
+        if (PyTuple_Check(key)) {
+            if (PyTuple_GET_SIZE(key) != 2) {
+                ret = -1;
+                goto error;
+            }
+            keyns = PyTuple_GET_ITEM(key, 0);
+            keyname = PyTuple_GET_ITEM(key, 1);
+            if (keyns == Py_None) {
+                ret = -1;
+                goto error;
+            }
+        } else {
+            keyns = Py_None;
+            keyname = key;
+        }
+
+        if (keyname == Py_None ||
+            (!PyString_Check(value) && !PyUnicode_Check(value))) {
+            ret = -1;
+            goto error;
+        }
+
+        if ((ret = write_binary_string_ref(b, t, keyns)) <= 0 ||
+            (ret = write_binary_string_ref(b, t, keyname)) <= 0)
+            goto error;
+
+        Py_INCREF(value);
+        value = make_utf8_string(value);
+        ret = value && binbuf_write_bytes(b, PyString_AS_STRING(value),
+                                          PyString_GET_SIZE(value));
+        Py_XDECREF(value);
+        if (!ret) goto error;
+    }
+
+    /* local prefixes */
+    if (localPrefs && PyDict_Check(localPrefs)) {
+        if (!binbuf_write_u32(b, (unsigned int)PyDict_Size(localPrefs)))
+            goto error;
+
+        dictpos = 0;
+        while (PyDict_Next(localPrefs, &dictpos, &key, &value)) {
+            if (key == Py_None || value == Py_None) {
+                ret = -1;
+                goto error;
+            }
+            if ((ret = write_binary_string_ref(b, t, key)) <= 0 ||
+                (ret = write_binary_string_ref(b, t, value)) <= 0)
+                goto error;
+        }
+    } else {
+        if (!binbuf_write_u32(b, 0))
+            goto error;
+    }
+
+    /* children */
+    size = PyList_GET_SIZE(children);
+    if (!binbuf_write_u32(b, (unsigned int)size))
+        goto error;
+
+    for (i = 0; i < size; i++) {
+        ret = do_serialize_binary(PyList_GET_ITEM(children, i), t, b);
+        if (ret <= 0)
+            goto error;
+    }
+
+    ret = 1;
+    /* fall through */
+
+error:
+    Py_DECREF(uri);
+    Py_DECREF(name);
+    Py_DECREF(defUri);
+    Py_DECREF(attrs);
+    Py_DECREF(children);
+    if (localPrefs) { Py_DECREF(localPrefs); }
+
+    return ret;
+}
+
+PyDoc_STRVAR(serializeBinary__doc__,
+             "Serialize a domish element to the compact binary form.");
+
+static PyObject *serializeBinary(PyObject *self, PyObject *args)
+{
+    PyObject *element, *result;
+    strtab_t t;
+    binbuf_t b;
+    int ok, size;
+
+    if (!PyArg_ParseTuple(args, "O", &element))
+        return NULL;
+
+    t.index = PyDict_New();
+    if (!t.index) return NULL;
+    t.table.data = NULL;
+    t.table.pos = t.table.len = 0;
+    t.count = 0;
+    b.data = NULL;
+    b.pos = b.len = 0;
+
+    ok = do_serialize_binary(element, &t, &b);
+
+    result = NULL;
+    if (ok > 0) {
+        size = BINARY_HEADER_SIZE + t.table.pos + b.pos;
+        result = PyString_FromStringAndSize(NULL, size);
+        if (result) {
+            char *p = PyString_AS_STRING(result);
+
+            memcpy(p, BINARY_MAGIC, 4);
+            put_u32(p + 4, (unsigned int)size);
+            put_u32(p + 8, t.count);
+            p += BINARY_HEADER_SIZE;
+            memcpy(p, t.table.data, t.table.pos);
+            p += t.table.pos;
+            memcpy(p, b.data, b.pos);
+        }
+    } else if (ok < 0) {
+        PyErr_SetString(PyExc_TypeError, "Incorrect object in element tree.");
+    } else if (!PyErr_Occurred()) {
+        PyErr_SetString(PyExc_RuntimeError, "memory allocation failed");
+    }
+
+    Py_DECREF(t.index);
+    if (t.table.data) free(t.table.data);
+    if (b.data) free(b.data);
+
+    return result;
+}
+
+typedef struct {
+    const unsigned char *data;
+    Py_ssize_t pos;
+    Py_ssize_t len;
+    PyObject *strings;
+    PyObject *element_class;
+    PyObject *raw_class;
+} binreader_t;
+
+static int read_u32(binreader_t *r, unsigned int *v)
+{
+    if (r->len - r->pos < 4)
+        return 0;
+    *v = get_u32(&r->data[r->pos]);
+    r->pos += 4;
+    return 1;
+}
+
+/* returns a new reference to a unicode object for the next
+ * length-prefixed byte string.
+ */
+static PyObject *read_bytes(binreader_t *r)
+{
+    unsigned int size;
+    PyObject *result;
+
+    if (!read_u32(r, &size) || (Py_ssize_t)size > r->len - r->pos)
+        return NULL;
+
+    result = PyUnicode_DecodeUTF8((const char *)&r->data[r->pos], size, NULL);
+    r->pos += size;
+    return result;
+}
+
+/* returns a borrowed reference from the string table, or Py_None when
+ * allowNone is set and the reference is NO_STRING */
+static PyObject *read_string_ref(binreader_t *r, int allowNone)
+{
+    unsigned int idx;
+
+    if (!read_u32(r, &idx))
+        return NULL;
+    if (idx == NO_STRING)
+        return allowNone ? Py_None : NULL;
+    if (idx >= (unsigned int)PyList_GET_SIZE(r->strings))
+        return NULL;
+    return PyList_GET_ITEM(r->strings, idx);
+}
+
+static PyObject *do_deserialize_binary(binreader_t *r)
+{
+    PyObject *element, *uri, *name, *defUri, *qname, *dict, *key, *value,
+        *child, *ok;
+    unsigned int i, count;
+    char tag;
+
+    if (r->pos >= r->len)
+        return NULL;
+    tag = r->data[r->pos++];
+
+    if (tag == 'T')
+        return read_bytes(r);
+
+    if (tag == 'R') {
+        value = read_bytes(r);
+        if (!value) return NULL;
+        child = PyObject_CallFunctionObjArgs(r->raw_class, value, NULL);
+        Py_DECREF(value);
+        return child;
+    }
+
+    if (tag != 'E')
+        return NULL;
+
+    if (!(uri = read_string_ref(r, 1)) || !(name = read_string_ref(r, 0)) ||
+        !(defUri = read_string_ref(r, 1)))
+        return NULL;
+
+    qname = PyTuple_Pack(2, uri, name);
+    if (!qname) return NULL;
+    element = PyObject_CallFunctionObjArgs(r->element_class, qname, NULL);
+    Py_DECREF(qname);
+    if (!element) return NULL;
+
+    if (PyObject_SetAttrString(element, "defaultUri", defUri) < 0)
+        goto error;
+
+    /* attributes */
+    if (!read_u32(r, &count))
+        goto error;
+    dict = PyDict_New();
+    if (!dict) goto error;
+    for (i = 0; i < count; i++) {
+        if (!(uri = read_string_ref(r, 1)) ||
+            !(name = read_string_ref(r, 0)) || !(value = read_bytes(r))) {
+            Py_DECREF(dict);
+            goto error;
+        }
+        if (uri == Py_None) {
+            key = name;
+            Py_INCREF(key);
+        } else {
+            key = PyTuple_Pack(2, uri, name);
+        }
+        if (!key || PyDict_SetItem(dict, key, value) < 0) {
+            Py_XDECREF(key);
+            Py_DECREF(value);
+            Py_DECREF(dict);
+            goto error;
+        }
+        Py_DECREF(key);
+        Py_DECREF(value);
+    }
+    i = PyObject_SetAttrString(element, "attributes", dict);
+    Py_DECREF(dict);
+    if (i) goto error;
+
+    /* local prefixes */
+    if (!read_u32(r, &count))
+        goto error;
+    dict = PyDict_New();
+    if (!dict) goto error;
+    for (i = 0; i < count; i++) {
+        if (!(key = read_string_ref(r, 0)) ||
+            !(value = read_string_ref(r, 0)) ||
+            PyDict_SetItem(dict, key, value) < 0) {
+            Py_DECREF(dict);
+            goto error;
+        }
+    }
+    i = PyObject_SetAttrString(element, "localPrefixes", dict);
+    Py_DECREF(dict);
+    if (i) goto error;
+
+    /* children */
+    if (!read_u32(r, &count))
+        goto error;
+    for (i = 0; i < count; i++) {
+        /* the message comes from another node, so its nesting must not
+         * be allowed to run us out of C stack */
+        if (Py_EnterRecursiveCall(" in deserializeBinary"))
+            goto error;
+        child = do_deserialize_binary(r);
+        Py_LeaveRecursiveCall();
+        if (!child) goto error;
+        ok = PyObject_CallMethod(element, "addChild", "O", child);
+        Py_DECREF(child);
+        if (!ok) goto error;
+        Py_DECREF(ok);
+    }
+
+    return element;
+
+error:
+    Py_DECREF(element);
+    return NULL;
+}
+
+PyDoc_STRVAR(deserializeBinary__doc__,
+             "Rebuild a domish element from the compact binary form.");
+
+static PyObject *deserializeBinary(PyObject *self, PyObject *args)
+{
+    PyObject *domish, *result;
+    binreader_t r;
+    const char *data;
+    int size;
+    unsigned int i, count;
+
+    if (!PyArg_ParseTuple(args, "s#", &data, &size))
+        return NULL;
+
+    if (size < BINARY_HEADER_SIZE || memcmp(data, BINARY_MAGIC, 4) != 0 ||
+        get_u32((const unsigned char *)data + 4) != (unsigned int)size) {
+        PyErr_SetString(PyExc_ValueError, "Malformed binary serialization.");
+        return NULL;
+    }
+
+    domish = PyImport_ImportModule("twisted.words.xish.domish");
+    if (!domish) return NULL;
+
+    r.data = (const unsigned char *)data;
+    r.pos = 8;
+    r.len = size;
+    r.element_class = PyObject_GetAttrString(domish, "Element");
+    r.raw_class = PyObject_GetAttrString(domish, "SerializedXML");
+    r.strings = PyList_New(0);
+    Py_DECREF(domish);
+
+    result = NULL;
+    if (!r.element_class || !r.raw_class || !r.strings)
+        goto done;
+
+    if (!read_u32(&r, &count))
+        goto done;
+    for (i = 0; i < count; i++) {
+        PyObject *s = read_bytes(&r);
+        if (!s || PyList_Append(r.strings, s) < 0) {
+            Py_XDECREF(s);
+            goto done;
+        }
+        Py_DECREF(s);
+    }
+
+    result = do_deserialize_binary(&r);
+    if (result && r.pos != r.len) {
+        Py_DECREF(result);
+        result = NULL;
+    }
+
+done:
+    if (!result && (!PyErr_Occurred() ||
+                    PyErr_ExceptionMatches(PyExc_UnicodeDecodeError))) {
+        PyErr_Clear();
+        PyErr_SetString(PyExc_ValueError, "Malformed binary serialization.");
+    }
+    Py_XDECREF(r.element_class);
+    Py_XDECREF(r.raw_class);
+    Py_XDECREF(r.strings);
+
+    return result;
+}
+
+/* append-only stanza archive
+ *
+ * elements are serialized straight into a memory mapped segment file of
+ * fixed capacity, so archiving a stanza costs no intermediate copies.
+ * the file layout is
+ *
+ *   "CSA1"                      magic
+ *   u32 count                   number of records
+ *   u32 end                     offset of the first unused byte
+ *   u32 reserved
+ *   records, each u32 size followed by size bytes of UTF-8 XML
+ *
+ * the header is only updated after a record has been written, so a
+ * crash mid-append loses at most that record.  record offsets are kept
+ * in memory and rebuilt from the file when it is reopened.
+ */
+
+#define ARCHIVE_MAGIC "CSA1"
+#define ARCHIVE_HEADER_SIZE 16
+#define ARCHIVE_DEFAULT_CAPACITY (16 * 1024 * 1024)
+
+typedef struct {
+    PyObject_HEAD
+    char *map;
+    int capacity;
+    int end;
+    int count;
+    int *offsets;
+    int offsets_len;
+    int busy;           /* an append is serializing into map */
+} Archive;
+
+static void archive_unmap(Archive *self)
+{
+    if (self->map) {
+        munmap(self->map, self->capacity);
+        self->map = NULL;
+    }
+    if (self->offsets) {
+        free(self->offsets);
+        self->offsets = NULL;
+    }
+    self->count = 0;
+    self->offsets_len = 0;
+}
+
+static int archive_add_offset(Archive *self, int offset)
+{
+    int *offsets;
+    int len;
+
+    if (self->count == self->offsets_len) {
+        len = self->offsets_len ? self->offsets_len * 2 : 1024;
+        offsets = (int *)realloc(self->offsets, len * sizeof(int));
+        if (!offsets)
+            return 0;
+        self->offsets = offsets;
+        self->offsets_len = len;
+    }
+
+    self->offsets[self->count++] = offset;
+    return 1;
+}
+
+static int archive_check_open(Archive *self)
+{
+    if (!self->map) {
+        PyErr_SetString(PyExc_ValueError, "archive is closed");
+        return 0;
+    }
+    return 1;
+}
+
+/* the element's python code runs while append() writes into the map,
+ * and must not unmap it or append at the same offset */
+static int archive_check_idle(Archive *self)
+{
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "archive is in the middle of an append");
+        return 0;
+    }
+    return 1;
+}
+
+static void archive_dealloc(Archive *self)
+{
+    archive_unmap(self);
+    self->ob_type->tp_free((PyObject *)self);
+}
+
+static int archive_init(Archive *self, PyObject *args, PyObject *kwargs)
+{
+    char *path;
+    int fd, ok, pos, size, count, end;
+    int capacity = ARCHIVE_DEFAULT_CAPACITY;
+    struct stat st;
+
+    static char *kwlist[] = {"path", "capacity", NULL};
+
+    ok = PyArg_ParseTupleAndKeywords(args, kwargs, "s|i", kwlist,
+                                     &path, &capacity);
+    if (!ok || !archive_check_idle(self)) return -1;
+
+    archive_unmap(self);
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    /* an existing segment keeps the capacity it was created with */
+    if (st.st_size > 0) {
+        if (st.st_size < ARCHIVE_HEADER_SIZE || st.st_size > INT_MAX) {
+            close(fd);
+            PyErr_SetString(PyExc_ValueError, "not an archive segment");
+            return -1;
+        }
+        capacity = (int)st.st_size;
+    } else {
+        if (capacity < ARCHIVE_HEADER_SIZE) {
+            close(fd);
+            PyErr_SetString(PyExc_ValueError, "capacity is too small");
+            return -1;
+        }
+        if (ftruncate(fd, capacity) < 0) {
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+            close(fd);
+            return -1;
+        }
+    }
+
+    self->map = (char *)mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, fd, 0);
+    close(fd);
+    if (self->map == MAP_FAILED) {
+        self->map = NULL;
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        return -1;
+    }
+    self->capacity = capacity;
+
+    if (st.st_size == 0) {
+        memcpy(self->map, ARCHIVE_MAGIC, 4);
+        put_u32(self->map + 4, 0);
+        put_u32(self->map + 8, ARCHIVE_HEADER_SIZE);
+        put_u32(self->map + 12, 0);
+    }
+
+    /* rebuild the offset index */
+    count = (int)get_u32((unsigned char *)self->map + 4);
+    end = (int)get_u32((unsigned char *)self->map + 8);
+    if (memcmp(self->map, ARCHIVE_MAGIC, 4) != 0 || count < 0 ||
+        end < ARCHIVE_HEADER_SIZE || end > capacity)
+        goto corrupt;
+
+    pos = ARCHIVE_HEADER_SIZE;
+    while (self->count < count) {
+        if (end - pos < 4)
+            goto corrupt;
+        size = (int)get_u32((unsigned char *)self->map + pos);
+        if (size < 0 || size > end - pos - 4)
+            goto corrupt;
+        if (!archive_add_offset(self, pos)) {
+            archive_unmap(self);
+            PyErr_SetString(PyExc_RuntimeError, "memory allocation failed");
+            return -1;
+        }
+        pos += 4 + size;
+    }
+    if (pos != end)
+        goto corrupt;
+    self->end = end;
+
+    return 0;
+
+corrupt:
+    archive_unmap(self);
+    PyErr_SetString(PyExc_ValueError, "corrupt archive segment");
+    return -1;
+}
+
+PyDoc_STRVAR(archive_append__doc__,
+             "append(element, prefixes=None, closeElement=1, "
+             "defaultUri=None, prefixesInScope=None,\n"
+             "       sanitize=SANITIZE_NONE)\n\n"
+             "Serialize element into the archive and return its record "
+             "number.\nRaises SerializationLimitError if the segment is "
+             "full.");
+
+static PyObject *archive_append(Archive *self, PyObject *args,
+                                PyObject *kwargs)
+{
+    int ok, size, limit, pos;
+    int prefixCounter = 0;
+    int closeElement = 1;
+    int sanitize = SANITIZE_NONE;
+    PyObject *element;
+    PyObject *prefixdict = NULL;
+    PyObject *defaultUri = NULL;
+    PyObject *prefixesInScope = NULL;
+    prefix_t *prefixes;
+
+    static char *kwlist[] = {"element", "prefixes", "closeElement",
+                             "defaultUri", "prefixesInScope", "sanitize",
+                             NULL};
+
+    ok = PyArg_ParseTupleAndKeywords(args, kwargs, "O|OiOOi", kwlist,
+                                     &element, &prefixdict, &closeElement,
+                                     &defaultUri, &prefixesInScope,
+                                     &sanitize);
+    if (!ok) return NULL;
+
+    if (!check_sanitize(sanitize) || !archive_check_open(self) ||
+        !archive_check_idle(self))
+        return NULL;
+
+    if (build_prefixes(prefixdict, prefixesInScope, &prefixes) < 0)
+        return NULL;
+
+    /* serialize in place after the size field, leaving room for the
+     * terminator strcpy writes */
+    pos = self->end + 4;
+    limit = self->capacity - 1;
+    size = SERIALIZE_FULL;
+    if (pos < limit) {
+        self->busy = 1;
+        size = do_serialize(element, NULL, prefixes, closeElement, sanitize,
+                            &prefixCounter, self->map, pos, limit);
+        self->busy = 0;
+    }
+    prefix_free_list(prefixes);
+
+    if (size == SERIALIZE_FULL) {
+        PyErr_SetString(SerializationLimitError, "archive segment is full");
+        return NULL;
+    }
+    if (size < 0) {
+        PyErr_SetString(PyExc_TypeError, "Incorrect object in element tree.");
+        return NULL;
+    }
+
+    if (!archive_add_offset(self, self->end)) {
+        PyErr_SetString(PyExc_RuntimeError, "memory allocation failed");
+        return NULL;
+    }
+
+    /* commit the record */
+    put_u32(self->map + self->end, (unsigned int)(size - pos));
+    self->end = size;
+    put_u32(self->map + 8, (unsigned int)self->end);
+    put_u32(self->map + 4, (unsigned int)self->count);
+
+    return PyInt_FromLong(self->count - 1);
+}
+
+PyDoc_STRVAR(archive_flush__doc__,
+             "flush()\n\nWrite the mapped segment back to disk.");
+
+static PyObject *archive_flush(Archive *self)
+{
+    if (!archive_check_open(self))
+        return NULL;
+
+    if (msync(self->map, self->end, MS_SYNC) < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(archive_close__doc__,
+             "close()\n\nFlush and unmap the segment.  Records read from "
+             "the archive\nbecome unusable.");
+
+static PyObject *archive_close(Archive *self)
+{
+    if (!archive_check_idle(self))
+        return NULL;
+
+    if (self->map && msync(self->map, self->end, MS_SYNC) < 0) {
+        archive_unmap(self);
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+
+    archive_unmap(self);
+    Py_RETURN_NONE;
+}
+
+static Py_ssize_t archive_length(Archive *self)
+{
+    return self->count;
+}
+
+/* records are returned as read-only buffers over the mapping itself */
+static PyObject *archive_item(Archive *self, Py_ssize_t i)
+{
+    int offset;
+
+    if (!archive_check_open(self))
+        return NULL;
+
+    if (i < 0 || i >= self->count) {
+        PyErr_SetString(PyExc_IndexError, "record index out of range");
+        return NULL;
+    }
+
+    offset = self->offsets[i];
+    return PyBuffer_FromObject((PyObject *)self, offset + 4,
+                               get_u32((unsigned char *)self->map + offset));
+}
+
+static Py_ssize_t archive_getreadbuffer(Archive *self, Py_ssize_t segment,
+                                        void **ptr)
+{
+    if (segment != 0) {
+        PyErr_SetString(PyExc_SystemError,
+                        "accessing non-existent archive segment");
+        return -1;
+    }
+    if (!archive_check_open(self))
+        return -1;
+
+    *ptr = self->map;
+    return self->end;
+}
+
+static Py_ssize_t archive_getsegcount(Archive *self, Py_ssize_t *lenp)
+{
+    if (lenp)
+        *lenp = self->map ? self->end : 0;
+    return 1;
+}
+
+static PySequenceMethods archive_as_sequence = {
+    (lenfunc)archive_length,            /* sq_length */
+    0,                                  /* sq_concat */
+    0,                                  /* sq_repeat */
+    (ssizeargfunc)archive_item,         /* sq_item */
+};
+
+static PyBufferProcs archive_as_buffer = {
+    (readbufferproc)archive_getreadbuffer,
+    0,
+    (segcountproc)archive_getsegcount,
+    (charbufferproc)archive_getreadbuffer,
+};
+
+static PyMethodDef archive_methods[] = {
+    {"append", (PyCFunction)archive_append,
+     METH_VARARGS | METH_KEYWORDS, archive_append__doc__},
+    {"flush", (PyCFunction)archive_flush, METH_NOARGS, archive_flush__doc__},
+    {"close", (PyCFunction)archive_close, METH_NOARGS, archive_close__doc__},
+    {NULL, NULL}
+};
+
+PyDoc_STRVAR(Archive__doc__,
+             "Archive(path, capacity=16MB)\n\n"
+             "Append-only, memory mapped segment file of serialized "
+             "elements.\nRecords are read back by number as zero-copy "
+             "buffers.");
+
+static PyTypeObject ArchiveType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                                  /* ob_size */
+    "cserialize.Archive",               /* tp_name */
+    sizeof(Archive),                    /* tp_basicsize */
+    0,                                  /* tp_itemsize */
+    (destructor)archive_dealloc,        /* tp_dealloc */
+    0,                                  /* tp_print */
+    0,                                  /* tp_getattr */
+    0,                                  /* tp_setattr */
+    0,                                  /* tp_compare */
+    0,                                  /* tp_repr */
+    0,                                  /* tp_as_number */
+    &archive_as_sequence,               /* tp_as_sequence */
+    0,                                  /* tp_as_mapping */
+    0,                                  /* tp_hash */
+    0,                                  /* tp_call */
+    0,                                  /* tp_str */
+    0,                                  /* tp_getattro */
+    0,                                  /* tp_setattro */
+    &archive_as_buffer,                 /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                 /* tp_flags */
+    Archive__doc__,                     /* tp_doc */
+    0,                                  /* tp_traverse */
+    0,                                  /* tp_clear */
+    0,                                  /* tp_richcompare */
+    0,                                  /* tp_weaklistoffset */
+    0,                                  /* tp_iter */
+    0,                                  /* tp_iternext */
+    archive_methods,                    /* tp_methods */
+    0,                                  /* tp_members */
+    0,                                  /* tp_getset */
+    0,                                  /* tp_base */
+    0,                                  /* tp_dict */
+    0,                                  /* tp_descr_get */
+    0,                                  /* tp_descr_set */
+    0,                                  /* tp_dictoffset */
+    (initproc)archive_init,             /* tp_init */
+    0,                                  /* tp_alloc */
+    PyType_GenericNew,                  /* tp_new */
+};
+
+/* lazily rendered serialization
+ *
+ * captures an element and the serialize() arguments, and only runs the
+ * serializer the first time the bytes are needed, through the buffer
+ * protocol, len() or str().  the UTF-8 result is kept and the element is
+ * released, so rendering happens at most once.
+ */
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *element;
+    PyObject *prefixdict;
+    PyObject *defaultUri;
+    PyObject *prefixesInScope;
+    int closeElement;
+    int sanitize;
+    PyObject *data;
+} LazySerialization;
+
+static int lazy_traverse(LazySerialization *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->element);
+    Py_VISIT(self->prefixdict);
+    Py_VISIT(self->defaultUri);
+    Py_VISIT(self->prefixesInScope);
+    return 0;
+}
+
+static int lazy_clear(LazySerialization *self)
+{
+    Py_CLEAR(self->element);
+    Py_CLEAR(self->prefixdict);
+    Py_CLEAR(self->defaultUri);
+    Py_CLEAR(self->prefixesInScope);
+    return 0;
+}
+
+static void lazy_dealloc(LazySerialization *self)
+{
+    PyObject_GC_UnTrack(self);
+    lazy_clear(self);
+    Py_CLEAR(self->data);
+    self->ob_type->tp_free((PyObject *)self);
+}
+
+static int lazy_init(LazySerialization *self, PyObject *args,
+                     PyObject *kwargs)
+{
+    int ok;
+    PyObject *element;
+    PyObject *prefixdict = NULL;
+    PyObject *defaultUri = NULL;
+    PyObject *prefixesInScope = NULL;
+    int closeElement = 1;
+    int sanitize = SANITIZE_NONE;
+
+    static char *kwlist[] = {"element", "prefixes", "closeElement",
+                             "defaultUri", "prefixesInScope", "sanitize",
+                             NULL};
+
+    ok = PyArg_ParseTupleAndKeywords(args, kwargs, "O|OiOOi", kwlist,
+                                     &element, &prefixdict, &closeElement,
+                                     &defaultUri, &prefixesInScope,
+                                     &sanitize);
+    if (!ok || !check_sanitize(sanitize)) return -1;
+
+    lazy_clear(self);
+    Py_CLEAR(self->data);
+
+    Py_INCREF(element);
+    Py_XINCREF(prefixdict);
+    Py_XINCREF(defaultUri);
+    Py_XINCREF(prefixesInScope);
+    self->element = element;
+    self->prefixdict = prefixdict;
+    self->defaultUri = defaultUri;
+    self->prefixesInScope = prefixesInScope;
+    self->closeElement = closeElement;
+    self->sanitize = sanitize;
+
+    return 0;
+}
+
+/* render on first use.  returns 0 with an exception set on failure, in
+ * which case a later call tries again.
+ */
+static int lazy_render(LazySerialization *self)
+{
+    char buf[4096], *out;
+    int size;
+    PyObject *element, *prefixdict, *prefixesInScope, *data;
+
+    if (self->data)
+        return 1;
+    if (!self->element) {
+        PyErr_SetString(PyExc_ValueError,
+                        "LazySerialization not initialized");
+        return 0;
+    }
+
+    /* the element's python code may call __init__ again and replace
+     * these while they are in use */
+    element = self->element;
+    prefixdict = self->prefixdict;
+    prefixesInScope = self->prefixesInScope;
+    Py_INCREF(element);
+    Py_XINCREF(prefixdict);
+    Py_XINCREF(prefixesInScope);
+
+    size = serialize_to_buffer(element, prefixdict, self->closeElement,
+                               prefixesInScope, self->sanitize, 0,
+                               buf, sizeof(buf), &out);
+    Py_DECREF(element);
+    Py_XDECREF(prefixdict);
+    Py_XDECREF(prefixesInScope);
+    if (size < 0)
+        return 0;
+
+    data = PyString_FromStringAndSize(out, size);
+    if (out != buf)
+        free(out);
+    if (!data)
+        return 0;
+
+    /* a nested render got there first */
+    if (self->data) {
+        Py_DECREF(data);
+        return 1;
+    }
+
+    self->data = data;
+    lazy_clear(self);
+    return 1;
+}
+
+PyDoc_STRVAR(lazy_isRendered__doc__,
+             "isRendered()\n\nReturn whether the element has been "
+             "serialized yet.");
+
+static PyObject *lazy_isRendered(LazySerialization *self)
+{
+    return PyBool_FromLong(self->data != NULL);
+}
+
+PyDoc_STRVAR(lazy_unicode__doc__,
+             "__unicode__()\n\nReturn the serialization as unicode, "
+             "like serialize().");
+
+static PyObject *lazy_unicode(LazySerialization *self)
+{
+    if (!lazy_render(self))
+        return NULL;
+
+    return PyUnicode_DecodeUTF8(PyString_AS_STRING(self->data),
+                                PyString_GET_SIZE(self->data), NULL);
+}
+
+static PyObject *lazy_str(LazySerialization *self)
+{
+    if (!lazy_render(self))
+        return NULL;
+
+    Py_INCREF(self->data);
+    return self->data;
+}
+
+static Py_ssize_t lazy_length(LazySerialization *self)
+{
+    if (!lazy_render(self))
+        return -1;
+
+    return PyString_GET_SIZE(self->data);
+}
+
+static Py_ssize_t lazy_getreadbuffer(LazySerialization *self,
+                                     Py_ssize_t segment, void **ptr)
+{
+    if (segment != 0) {
+        PyErr_SetString(PyExc_SystemError,
+                        "accessing non-existent serialization segment");
+        return -1;
+    }
+    if (!lazy_render(self))
+        return -1;
+
+    *ptr = PyString_AS_STRING(self->data);
+    return PyString_GET_SIZE(self->data);
+}
+
+static Py_ssize_t lazy_getsegcount(LazySerialization *self, Py_ssize_t *lenp)
+{
+    /* there is no way to report an error here; a failed render is
+     * retried and reported by the getreadbuffer call that follows */
+    if (lenp) {
+        if (lazy_render(self)) {
+            *lenp = PyString_GET_SIZE(self->data);
+        } else {
+            PyErr_Clear();
+            *lenp = 0;
+        }
+    }
+    return 1;
+}
+
+/* a handle is always true, so that truth tests don't render it */
+static int lazy_nonzero(LazySerialization *self)
+{
+    if (!self->data && !self->element) {
+        PyErr_SetString(PyExc_ValueError,
+                        "LazySerialization not initialized");
+        return -1;
+    }
+
+    return 1;
+}
+
+static PyNumberMethods lazy_as_number = {
+    0,                                  /* nb_add */
+    0,                                  /* nb_subtract */
+    0,                                  /* nb_multiply */
+    0,                                  /* nb_divide */
+    0,                                  /* nb_remainder */
+    0,                                  /* nb_divmod */
+    0,                                  /* nb_power */
+    0,                                  /* nb_negative */
+    0,                                  /* nb_positive */
+    0,                                  /* nb_absolute */
+    (inquiry)lazy_nonzero,              /* nb_nonzero */
+};
+
+static PySequenceMethods lazy_as_sequence = {
+    (lenfunc)lazy_length,               /* sq_length */
+};
+
+static PyBufferProcs lazy_as_buffer = {
+    (readbufferproc)lazy_getreadbuffer,
+    0,
+    (segcountproc)lazy_getsegcount,
+    (charbufferproc)lazy_getreadbuffer,
+};
+
+static PyMethodDef lazy_methods[] = {
+    {"isRendered", (PyCFunction)lazy_isRendered, METH_NOARGS,
+     lazy_isRendered__doc__},
+    {"__unicode__", (PyCFunction)lazy_unicode, METH_NOARGS,
+     lazy_unicode__doc__},
+    {NULL, NULL}
+};
+
+PyDoc_STRVAR(LazySerialization__doc__,
+             "LazySerialization(element, prefixes=None, closeElement=1, "
+             "defaultUri=None,\n                  prefixesInScope=None, "
+             "sanitize=SANITIZE_NONE)\n\n"
+             "Serialize element the first time its bytes are needed, "
+             "through\nthe buffer protocol, len() or str().  The UTF-8 "
+             "result is kept.\nChanges made to element before that point "
+             "are included.");
+
+static PyTypeObject LazySerializationType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                                  /* ob_size */
+    "cserialize.LazySerialization",     /* tp_name */
+    sizeof(LazySerialization),          /* tp_basicsize */
+    0,                                  /* tp_itemsize */
+    (destructor)lazy_dealloc,           /* tp_dealloc */
+    0,                                  /* tp_print */
+    0,                                  /* tp_getattr */
+    0,                                  /* tp_setattr */
+    0,                                  /* tp_compare */
+    0,                                  /* tp_repr */
+    &lazy_as_number,                    /* tp_as_number */
+    &lazy_as_sequence,                  /* tp_as_sequence */
+    0,                                  /* tp_as_mapping */
+    0,                                  /* tp_hash */
+    0,                                  /* tp_call */
+    (reprfunc)lazy_str,                 /* tp_str */
+    0,                                  /* tp_getattro */
+    0,                                  /* tp_setattro */
+    &lazy_as_buffer,                    /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+    LazySerialization__doc__,           /* tp_doc */
+    (traverseproc)lazy_traverse,        /* tp_traverse */
+    (inquiry)lazy_clear,                /* tp_clear */
+    0,                                  /* tp_richcompare */
+    0,                                  /* tp_weaklistoffset */
+    0,                                  /* tp_iter */
+    0,                                  /* tp_iternext */
+    lazy_methods,                       /* tp_methods */
+    0,                                  /* tp_members */
+    0,                                  /* tp_getset */
+    0,                                  /* tp_base */
+    0,                                  /* tp_dict */
+    0,                                  /* tp_descr_get */
+    0,                                  /* tp_descr_set */
+    0,                                  /* tp_dictoffset */
+    (initproc)lazy_init,                /* tp_init */
+    0,                                  /* tp_alloc */
+    PyType_GenericNew,                  /* tp_new */
+};
+
+static PyMethodDef cserialize_methods[] = {
+    {"serialize", (PyCFunction)serialize, 
+     METH_VARARGS | METH_KEYWORDS, serialize__doc__},
+    {"serializeBinary", (PyCFunction)serializeBinary,
+     METH_VARARGS, serializeBinary__doc__},
+    {"deserializeBinary", (PyCFunction)deserializeBinary,
+     METH_VARARGS, deserializeBinary__doc__},
+    {NULL, NULL}
+};
+
+
+PyDoc_STRVAR(cserialize__doc__,
+             "Domish XML serializer in C.");
+
+PyMODINIT_FUNC initcserialize(void)
+{
+    PyObject *m;
+
+    init_encode_tables();
+
+    if (PyType_Ready(&ArchiveType) < 0 ||
+        PyType_Ready(&LazySerializationType) < 0)
+        return;
+
+    m = Py_InitModule3("cserialize", cserialize_methods, cserialize__doc__);
+    if (!m) return;
+
+    Py_INCREF(&ArchiveType);
+    PyModule_AddObject(m, "Archive", (PyObject *)&ArchiveType);
+    PyModule_AddIntConstant(m, "SANITIZE_NONE", SANITIZE_NONE);
+    PyModule_AddIntConstant(m, "SANITIZE_DROP", SANITIZE_DROP);
+    PyModule_AddIntConstant(m, "SANITIZE_REPLACE", SANITIZE_REPLACE);
+
+    Py_INCREF(&LazySerializationType);
+    PyModule_AddObject(m, "LazySerialization",
+                       (PyObject *)&LazySerializationType);
+
+    SerializationLimitError =
+        PyErr_NewException("cserialize.SerializationLimitError",
+                           PyExc_ValueError, NULL);
+    if (!SerializationLimitError) return;
+    Py_INCREF(SerializationLimitError);
+    PyModule_AddObject(m, "SerializationLimitError", SerializationLimitError);
 }
@@ -3,13 +3,14 @@
 # Benchmark which exercises the domish Element serialization code.
 # This benchmark reports the number of Elements per second which can be serialized.
 
+import multiprocessing
 import sys
 import time
 
 from twisted.words.xish import domish
 domish.USE_CSERIALIZE = False
 
-from cserialize import serialize
+from cserialize import serialize, serializeBinary, deserializeBinary
 
 def slowfunc_py(elements, count):
     for i in xrange(count):
@@ -21,6 +22,51 @@ def slowfunc_c(elements, count):
         for e in elements:
             serialize(e)
 
+def roundtrip_xml(elements, count):
+    parsed = []
+    parser = domish.elementStream()
+    parser.DocumentStartEvent = lambda e: None
+    parser.DocumentEndEvent = lambda: None
+    parser.ElementEvent = parsed.append
+    parser.parse('<stream>')
+    for i in xrange(count):
+        for e in elements:
+            parser.parse(serialize(e))
+        del parsed[:]
+
+def roundtrip_binary(elements, count):
+    for i in xrange(count):
+        for e in elements:
+            deserializeBinary(serializeBinary(e))
+
+def make_roster(count):
+    query = domish.Element(('jabber:iq:roster', 'query'))
+    for i in xrange(count):
+        item = query.addElement('item')
+        item['jid'] = 'user%d@chesspark.com' % i
+        item['name'] = 'User %d' % i
+        item['subscription'] = 'both'
+        item.addElement('group', content='Friends & Family')
+    return query
+
+def scaling(root, count):
+    print 'parallel: %d children, %d serializations' % (len(root.children),
+                                                      count)
+    base = None
+    for workers in xrange(1, multiprocessing.cpu_count() + 1):
+        before = time.time()
+        for i in xrange(count):
+            serialize(root, workers=workers)
+        elapsed = time.time() - before
+        if base is None:
+            base = elapsed
+        print '%3d workers: %0.2f seconds - %0.2fx' % (workers, elapsed,
+                                                      base / elapsed)
+
+def report(label, count, before, after):
+    print '%s: Serialized %d elements in %0.2f seconds - %d elements/second' % (
+        label, count, after - before, count / (after - before))
+
 testDocument = """\
 <stream>
     <iq xmlns='jabber:client' type='result' from='profile.chesspark.com' id='H_83833' to='arbiter.chesspark.com'/>
@@ -46,14 +92,19 @@ def main():
     before_c = time.time()
     slowfunc_c(elements, count)
     after_c = time.time()
-    print 'py: Serialized %d elements in %0.2f seconds - %d elements/second' % (
-        count * len(elements),
-        after_py - before_py,
-        (count * len(elements)) / (after_py - before_py))
-    print ' c: Serialized %d elements in %0.2f seconds - %d elements/second' % (
-        count * len(elements),
-        after_c - before_c,
-        (count * len(elements)) / (after_c - before_c))
+    report('py', count * len(elements), before_py, after_py)
+    report(' c', count * len(elements), before_c, after_c)
+
+    before = time.time()
+    roundtrip_xml(elements, count)
+    after = time.time()
+    report('xml round trip', count * len(elements), before, after)
+    before = time.time()
+    roundtrip_binary(elements, count)
+    after = time.time()
+    report('binary round trip', count * len(elements), before, after)
+
+    scaling(make_roster(5000), 50)
 
 if __name__ == '__main__':
     main()
@@ -1,7 +1,8 @@
 from distutils.core import setup, Extension
 
 mod = Extension('cserialize',
-                sources=['cserialize.c'])
+                sources=['cserialize.c'],
+                libraries=['pthread'])
 
 setup(name='cserialize',
       version='1.0',
@@ -1,7 +1,17 @@
+import cStringIO
+import os
+import random
+import resource
+import struct
+import tempfile
+from xml.parsers import expat
+
 from twisted.trial import unittest
 from twisted.words.xish import domish
 
-from cserialize import serialize
+from cserialize import serialize, serializeBinary, deserializeBinary
+from cserialize import SerializationLimitError, Archive, LazySerialization
+from cserialize import SANITIZE_NONE, SANITIZE_DROP, SANITIZE_REPLACE
 
 def error(expected, got):
     if type(expected) == list:
@@ -220,4 +230,554 @@ class SerializeTestCase(unittest.TestCase):
         e = "<foo>" + data + "</foo>"
         s = serialize(elem)
         self.check(e, s)
-        
+
+    def testMaxBytes(self):
+        elem = domish.Element((None, 'foo'))
+        elem.addContent(u'\u0080&')
+        e = u"<foo>\u0080&amp;</foo>"
+        s = serialize(elem, maxBytes=len(e.encode('utf-8')))
+        self.check(e, s)
+        self.assertRaises(SerializationLimitError, serialize, elem,
+                          maxBytes=len(e.encode('utf-8')) - 1)
+
+    def testMaxBytesLongResult(self):
+        elem = domish.Element((None, 'long'))
+        elem.addContent("&" * 4096)
+        self.assertRaises(SerializationLimitError, serialize, elem,
+                          maxBytes=10000)
+        s = serialize(elem, maxBytes=30000)
+        self.check(u"<long>%s</long>" % ("&amp;" * 4096,), s)
+
+    def testMaxBytesRawXML(self):
+        data = "<bar>" + ("abc" * 4096) + "</bar>"
+        elem = domish.Element((None, 'foo'))
+        elem.addRawXml(data)
+        self.assertRaises(SerializationLimitError, serialize, elem,
+                          maxBytes=len(data))
+        s = serialize(elem, maxBytes=len(data) + 11)
+        self.check("<foo>" + data + "</foo>", s)
+
+    def testMaxBytesIsValueError(self):
+        self.failUnless(issubclass(SerializationLimitError, ValueError))
+
+    def testLongResultNamespaces(self):
+        elem = domish.Element((None, 'foo'))
+        child = elem.addElement(('ns1', 'bar'), 'ns2')
+        child.addContent("&" * 4096)
+        elem[('ns3', 'baz')] = 'quux'
+        e = u"<foo xn0:baz='quux' xmlns:xn0='ns3'>"\
+            "<xn1:bar xmlns='ns2' xmlns:xn1='ns1'>%s</xn1:bar></foo>" % \
+            ("&amp;" * 4096,)
+        s = serialize(elem)
+        self.check(e, s)
+
+    def testWithHash(self):
+        s, h = serialize(u'abc', withHash=1)
+        self.check(u'abc', s)
+        self.failUnless(h == 0x44bc2cf5ad770999L, "Got wrong hash: %x" % h)
+        s, h = serialize(u'Nobody inspects the spammish repetition',
+                         withHash=1)
+        self.failUnless(h == 0xfbcea83c8a378bf1L, "Got wrong hash: %x" % h)
+
+    def testWithHashElement(self):
+        elem = domish.Element((None, 'long'))
+        elem['a'] = u'\u0080'
+        elem.addContent("&" * 4096)
+        s, h = serialize(elem, withHash=1)
+        self.check(serialize(elem), s)
+        self.failUnless(h == serialize(elem, withHash=1)[1])
+        elem.addContent("!")
+        self.failIf(h == serialize(elem, withHash=1)[1])
+
+    def testBadChild(self):
+        elem = domish.Element((None, 'foo'))
+        elem.addElement('bar')
+        elem.children.append(1)
+        self.assertRaises(TypeError, serialize, elem)
+
+    def testSanitizeNone(self):
+        elem = domish.Element((None, 'foo'))
+        elem.addContent(u'a\x01b')
+        s = serialize(elem, sanitize=SANITIZE_NONE)
+        self.check(u"<foo>a\x01b</foo>", s)
+
+    def testSanitizeDrop(self):
+        elem = domish.Element((None, 'foo'))
+        elem['a'] = u'x\x00y\'z'
+        elem.addContent(u'\t\n\r<\x08\x0b\x0c\x1f\ufffe\uffff\ufffd\u00e9')
+        e = u"<foo a='xy&apos;z'>\t\n\r&lt;\ufffd\u00e9</foo>"
+        s = serialize(elem, sanitize=SANITIZE_DROP)
+        self.check(e, s)
+
+    def testSanitizeReplace(self):
+        elem = domish.Element((None, 'foo'))
+        elem.addContent(u'a\x01b\uffffc')
+        e = u"<foo>a\ufffdb\ufffdc</foo>"
+        s = serialize(elem, sanitize=SANITIZE_REPLACE)
+        self.check(e, s)
+
+    def testSanitizeSurrogate(self):
+        e = u"ab\ud7ffc"
+        s = serialize('a\xed\xa0\x80b\xed\x9f\xbfc', sanitize=SANITIZE_DROP)
+        self.check(e, s)
+
+    def testSanitizeEverything(self):
+        s = serialize(u'\x01\x02', sanitize=SANITIZE_DROP)
+        self.check(u'', s)
+
+    def testSanitizeLongResult(self):
+        elem = domish.Element((None, 'long'))
+        elem.addContent(u"\x01&" * 4096)
+        e = u"<long>%s</long>" % (u"\ufffd&amp;" * 4096,)
+        s = serialize(elem, sanitize=SANITIZE_REPLACE)
+        self.check(e, s)
+
+    def testSanitizeDropMaxBytes(self):
+        elem = domish.Element((None, 'foo'))
+        elem['a'] = u'\x01' * 100
+        e = u"<foo a=''/>"
+        s = serialize(elem, sanitize=SANITIZE_DROP, maxBytes=len(e))
+        self.check(e, s)
+
+    def testSanitizeBadMode(self):
+        self.assertRaises(ValueError, serialize, u'', sanitize=3)
+
+    def testPrefixOutOfScopeForSibling(self):
+        elem = domish.Element((None, 'foo'))
+        child = elem.addElement('a')
+        child.addElement(('ns1', 'x'), 'ns2')
+        elem.addElement(('ns1', 'b'), 'ns2')
+        elem.addElement(('ns1', 'c'), 'ns2')
+        e = u"<foo><a><xn0:x xmlns='ns2' xmlns:xn0='ns1'/></a>"\
+            "<xn0:b xmlns='ns2' xmlns:xn0='ns1'/>"\
+            "<xn0:c xmlns='ns2' xmlns:xn0='ns1'/></foo>"
+        s = serialize(elem)
+        self.check(e, s)
+
+
+class ParallelSerializeTestCase(unittest.TestCase):
+    def makeRoster(self, count):
+        query = domish.Element(('jabber:iq:roster', 'query'))
+        for i in range(count):
+            item = query.addElement('item')
+            item['jid'] = u'user%d@example.com' % i
+            item['name'] = u'User & \u00e9 %d' % i
+            item.addElement('group', content=u'Friends')
+            if i % 10 == 0:
+                item[('urn:x-ns%d' % (i % 30), 'extra')] = 'x'
+            if i % 7 == 0:
+                item.addElement(('urn:other', 'note'), 'urn:other')
+            if i % 13 == 0:
+                item.addRawXml(u'<raw/>')
+        return query
+
+    def testSameAsSequential(self):
+        elem = self.makeRoster(500)
+        e = serialize(elem)
+        for workers in (2, 3, 4, 16):
+            s = serialize(elem, workers=workers)
+            self.failUnless(s == e, "Got different output with %d workers" %
+                            workers)
+
+    def testPrefixNumbering(self):
+        elem = domish.Element((None, 'foo'))
+        for i in range(200):
+            child = elem.addElement('bar')
+            child[('ns%d' % (i % 50), 'a')] = 'b'
+        s = serialize(elem, workers=4)
+        self.failUnless(s == serialize(elem))
+        self.failUnless(u"<bar xn49:a='b' xmlns:xn49='ns49'/>" in s)
+        self.failUnless(s.endswith(u"<bar xn49:a='b' xmlns:xn49='ns49'/>"
+                                   "</foo>"))
+
+    def testArguments(self):
+        elem = self.makeRoster(200)
+        elem.children[5].addContent(u'\x01')
+        kwargs = {'prefixes': {'jabber:iq:roster': 'r'},
+                  'sanitize': SANITIZE_REPLACE}
+        self.failUnless(serialize(elem, workers=4, **kwargs) ==
+                        serialize(elem, **kwargs))
+        self.failUnless(serialize(elem, workers=4, withHash=1) ==
+                        serialize(elem, withHash=1))
+        self.failUnless(serialize(elem, workers=4, closeElement=0) ==
+                        serialize(elem, closeElement=0))
+
+    def testFewChildren(self):
+        elem = self.makeRoster(3)
+        self.failUnless(serialize(elem, workers=4) == serialize(elem))
+
+    def testMaxBytes(self):
+        elem = self.makeRoster(200)
+        size = len(serialize(elem).encode('utf-8'))
+        s = serialize(elem, workers=4, maxBytes=size)
+        self.failUnless(s == serialize(elem))
+        self.assertRaises(SerializationLimitError, serialize, elem,
+                          workers=4, maxBytes=size - 1)
+        self.assertRaises(SerializationLimitError, serialize, elem,
+                          workers=4, maxBytes=1000)
+
+    def testMaxBytesStopsEarly(self):
+        # 256 children of 128 KiB each, all distinct unicode, so that
+        # every one of them needs its own UTF-8 copy.  the limit must
+        # be hit while the tree is copied, not after
+        elem = domish.Element((None, 'query'))
+        for i in range(256):
+            content = unicode(i % 10) * (128 << 10)
+            elem.addElement('item').children.append(content)
+        before = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+        for workers in (8, 64):
+            self.assertRaises(SerializationLimitError, serialize, elem,
+                              workers=workers, maxBytes=1 << 20)
+        after = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+        self.failUnless(after - before < 8 * 1024,
+                        "Peak RSS grew by %d KiB." % (after - before))
+
+    def testMaxBytesDropped(self):
+        # characters SANITIZE_DROP removes don't count against maxBytes
+        elem = self.makeRoster(100)
+        elem.children[0].addContent(u'\x01' * 100000)
+        kwargs = {'sanitize': SANITIZE_DROP}
+        size = len(serialize(elem, **kwargs).encode('utf-8'))
+        self.failUnless(serialize(elem, workers=4, maxBytes=size, **kwargs)
+                        == serialize(elem, **kwargs))
+        self.assertRaises(SerializationLimitError, serialize, elem,
+                          workers=4, maxBytes=size - 1, **kwargs)
+
+    def testBadChild(self):
+        elem = self.makeRoster(200)
+        elem.children[150].children.append(1)
+        self.assertRaises(TypeError, serialize, elem, workers=4)
+
+    def makeRandomElement(self, rand, depth):
+        uris = [None, 'a', 'b', 'c', 'd']
+        uri = rand.choice(uris)
+        defaultUri = uri
+        if rand.random() < 0.5:
+            defaultUri = rand.choice(uris)
+        localPrefixes = {}
+        if rand.random() < 0.15:
+            localPrefixes[rand.choice('pqr')] = rand.choice(uris[1:])
+        elem = domish.Element((uri, 'e%d' % rand.randint(0, 3)), defaultUri,
+                              localPrefixes=localPrefixes)
+        for i in range(rand.randint(0, 2)):
+            if rand.random() < 0.4:
+                elem[(rand.choice(uris[1:]), 'at%d' % i)] = u"v\x01<&'%d" % i
+            else:
+                elem['x%d' % i] = u'y'
+        if depth < 4:
+            for i in range(rand.randint(0, 4)):
+                if rand.random() < 0.7:
+                    elem.addChild(self.makeRandomElement(rand, depth + 1))
+                else:
+                    elem.addContent(u't&<\x0b\ufffe')
+        return elem
+
+    def testRandomTrees(self):
+        # random namespaced trees, many of them with a prefix declared
+        # deep inside one child and used again by a later sibling
+        rand = random.Random(1234)
+        for n in range(200):
+            elem = domish.Element((rand.choice([None, 'a', 'b']), 'root'))
+            for i in range(rand.choice([5, 70, 150])):
+                elem.addChild(self.makeRandomElement(rand, 1))
+            s = serialize(elem, sanitize=SANITIZE_DROP)
+            parser = expat.ParserCreate(namespace_separator=' ')
+            try:
+                parser.Parse(s.encode('utf-8'), True)
+            except expat.ExpatError, e:
+                self.fail("Tree %d is not well-formed: %s" % (n, e))
+            for workers in (2, 3, 8):
+                self.failUnless(serialize(elem, sanitize=SANITIZE_DROP,
+                                          workers=workers) == s,
+                                "Tree %d differs with %d workers" %
+                                (n, workers))
+
+
+class BinarySerializeTestCase(unittest.TestCase):
+    def roundTrip(self, elem):
+        data = serializeBinary(elem)
+        self.failUnless(type(data) == str, "Expected a byte string.")
+        result = deserializeBinary(data)
+        self.failUnless(serialize(result) == serialize(elem),
+                        error(serialize(elem), serialize(result)))
+        return result
+
+    def testSimpleElement(self):
+        result = self.roundTrip(domish.Element((None, 'simple')))
+        self.failUnless(result.name == 'simple')
+        self.failUnless(result.uri is None)
+
+    def testContent(self):
+        result = deserializeBinary(serializeBinary(u'some <content>'))
+        self.failUnless(result == u'some <content>')
+
+    def testAttrsAndContent(self):
+        elem = domish.Element(('somens', 'simple'))
+        elem['to'] = 'jack'
+        elem['a'] = u'one&two<three\'four\u0080'
+        elem.addContent(u'hello & <goodbye>')
+        result = self.roundTrip(elem)
+        self.failUnless(result.attributes == elem.attributes)
+        self.failUnless(result.defaultUri == 'somens')
+
+    def testQualifiedAttribute(self):
+        elem = domish.Element((None, 'foo'))
+        elem[('somens', 'bar')] = 'baz'
+        elem[('http://www.w3.org/XML/1998/namespace', 'lang')] = 'en_US'
+        result = self.roundTrip(elem)
+        self.failUnless(result[('somens', 'bar')] == 'baz')
+
+    def testNestedNamespaces(self):
+        elem = domish.Element((None, 'foo'))
+        child1 = elem.addElement(('ns1', 'bar'), 'ns2')
+        child1.addElement(('ns2', 'quux'))
+        child2 = elem.addElement(('ns3', 'baz'), 'ns4')
+        child2.addElement(('ns1', 'quux'))
+        result = self.roundTrip(elem)
+        self.failUnless(result.children[0].parent is result)
+
+    def testLocalPrefixes(self):
+        elem = domish.Element(('somens', 'foo'),
+                              localPrefixes={'somens': 'bar'})
+        result = self.roundTrip(elem)
+        self.failUnless(result.localPrefixes == {'somens': 'bar'})
+
+    def testRawXML(self):
+        elem = domish.Element((None, 'foo'))
+        elem.addRawXml(u"<degree>\u0080</degree>")
+        result = self.roundTrip(elem)
+        self.failUnless(result.children[0].__class__.__name__ ==
+                        'SerializedXML')
+
+    def testBadInput(self):
+        self.assertRaises(TypeError, serializeBinary, [])
+        elem = domish.Element((None, 'foo'))
+        elem.children.append(1)
+        self.assertRaises(TypeError, serializeBinary, elem)
+
+    def testMalformedData(self):
+        data = serializeBinary(domish.Element((None, 'foo')))
+        self.assertRaises(ValueError, deserializeBinary, 'garbage')
+        self.assertRaises(ValueError, deserializeBinary, data[:-1])
+        self.assertRaises(ValueError, deserializeBinary,
+                          data[:-4] + '\xff\xff\xff\x7f')
+
+    def testMissingNames(self):
+        # None is only valid for namespaces and default URIs
+        def message(node):
+            body = struct.pack('<II', 1, 3) + 'foo' + node
+            return 'CSB1' + struct.pack('<I', len(body) + 8) + body
+        none = 0xffffffff
+        element = 'E' + struct.pack('<III', none, 0, none)
+        attr = struct.pack('<I', 1) + 'v'
+        self.failUnless(deserializeBinary(message(
+            element + struct.pack('<III', 0, 0, 0))).name == 'foo')
+        for node in ['E' + struct.pack('<III', none, none, none) +
+                     struct.pack('<III', 0, 0, 0),
+                     element + struct.pack('<III', 1, none, none) + attr +
+                     struct.pack('<II', 0, 0),
+                     element + struct.pack('<IIII', 0, 1, none, 0) +
+                     struct.pack('<I', 0),
+                     element + struct.pack('<IIII', 0, 1, 0, none) +
+                     struct.pack('<I', 0)]:
+            self.assertRaises(ValueError, deserializeBinary, message(node))
+
+    def testDeepNesting(self):
+        # a truncated message nesting far more elements than the
+        # recursion limit allows
+        node = 'E' + struct.pack('<IIIIII', 0xffffffff, 0, 0xffffffff,
+                                 0, 0, 1)
+        body = struct.pack('<II', 1, 3) + 'foo' + node * 200000
+        data = 'CSB1' + struct.pack('<I', len(body) + 8) + body
+        self.assertRaises(RuntimeError, deserializeBinary, data)
+
+        elem = root = domish.Element((None, 'foo'))
+        for i in range(100):
+            elem = elem.addElement('bar')
+        self.roundTrip(root)
+
+
+class LazySerializationTestCase(unittest.TestCase):
+    def testRendersOnDemand(self):
+        elem = domish.Element((None, 'foo'))
+        lazy = LazySerialization(elem)
+        self.failIf(lazy.isRendered())
+        elem['a'] = u'\u0080'
+        s = str(lazy)
+        self.failUnless(lazy.isRendered())
+        self.failUnless(s == serialize(elem).encode('utf-8'))
+        self.failUnless(unicode(lazy) == serialize(elem))
+
+    def testMemoized(self):
+        elem = domish.Element((None, 'foo'))
+        lazy = LazySerialization(elem)
+        s = str(lazy)
+        elem['a'] = 'b'
+        self.failUnless(str(lazy) is s)
+
+    def testLength(self):
+        elem = domish.Element((None, 'foo'))
+        elem.addContent(u'\u0080')
+        lazy = LazySerialization(elem)
+        self.failUnless(len(lazy) == len(serialize(elem).encode('utf-8')))
+        self.failUnless(lazy.isRendered())
+
+    def testBuffer(self):
+        elem = domish.Element((None, 'long'))
+        elem.addContent("&" * 4096)
+        lazy = LazySerialization(elem)
+        self.failUnless(str(buffer(lazy)) ==
+                        serialize(elem).encode('utf-8'))
+        out = cStringIO.StringIO()
+        out.write(LazySerialization(elem))
+        self.failUnless(out.getvalue() == serialize(elem).encode('utf-8'))
+
+    def testArguments(self):
+        elem = domish.Element(('ns1', 'parent'), 'ns2')
+        lazy = LazySerialization(elem, prefixes={'ns1': 'prefix'},
+                                 closeElement=0)
+        self.failUnless(unicode(lazy) ==
+                        serialize(elem, prefixes={'ns1': 'prefix'},
+                                  closeElement=0))
+
+    def testBadInput(self):
+        lazy = LazySerialization([])
+        self.assertRaises(TypeError, str, lazy)
+        self.assertRaises(TypeError, len, lazy)
+        self.failIf(lazy.isRendered())
+
+    def makeMeddling(self, meddle):
+        class Meddling(domish.Element):
+            def getChildren(self):
+                meddle()
+                return self._children
+            def setChildren(self, children):
+                self._children = children
+            children = property(getChildren, setChildren)
+        return Meddling((None, 'foo'))
+
+    def testReinitDuringRender(self):
+        lazy = LazySerialization.__new__(LazySerialization)
+        other = domish.Element((None, 'bar'))
+        elem = self.makeMeddling(lambda: lazy.__init__(other,
+                                                       prefixes={'a': 'b'}))
+        lazy.__init__(elem, prefixes={'a': 'b'})
+        self.failUnless(str(lazy) == "<foo/>")
+        self.failUnless(lazy.isRendered())
+
+    def testNestedRender(self):
+        nested = []
+        def render():
+            if not nested:
+                nested.append(None)
+                nested.append(str(lazy))
+        lazy = LazySerialization.__new__(LazySerialization)
+        elem = self.makeMeddling(render)
+        lazy.__init__(elem)
+        s = str(lazy)
+        self.failUnless(s == "<foo/>")
+        self.failUnless(nested[1] is s)
+
+    def testTruthDoesNotRender(self):
+        lazy = LazySerialization(domish.Element((None, 'foo')))
+        self.failUnless(lazy)
+        self.failIf(lazy.isRendered())
+        str(lazy)
+        self.failUnless(lazy)
+
+    def testNotInitialized(self):
+        lazy = LazySerialization.__new__(LazySerialization)
+        self.assertRaises(ValueError, str, lazy)
+        self.assertRaises(ValueError, len, lazy)
+        self.assertRaises(ValueError, cStringIO.StringIO().write, lazy)
+        self.assertRaises(ValueError, bool, lazy)
+        self.failIf(lazy.isRendered())
+
+
+class ArchiveTestCase(unittest.TestCase):
+    def setUp(self):
+        fd, self.path = tempfile.mkstemp()
+        os.close(fd)
+        os.unlink(self.path)
+
+    def tearDown(self):
+        if os.path.exists(self.path):
+            os.unlink(self.path)
+
+    def testAppendAndRead(self):
+        archive = Archive(self.path, capacity=4096)
+        elem = domish.Element(('ns1', 'foo'))
+        elem['a'] = u'\u0080&'
+        self.failUnless(archive.append(elem) == 0)
+        self.failUnless(archive.append(u'content') == 1)
+        self.failUnless(len(archive) == 2)
+        self.failUnless(str(archive[0]) == serialize(elem).encode('utf-8'))
+        self.failUnless(str(archive[1]) == 'content')
+        self.failUnless(str(archive[-1]) == 'content')
+        self.assertRaises(IndexError, lambda: archive[2])
+        archive.close()
+
+    def testReopen(self):
+        archive = Archive(self.path, capacity=4096)
+        for i in range(10):
+            elem = domish.Element((None, 'item'))
+            elem['n'] = str(i)
+            archive.append(elem)
+        archive.close()
+
+        archive = Archive(self.path)
+        self.failUnless(len(archive) == 10)
+        self.failUnless(str(archive[3]) == "<item n='3'/>")
+        self.failUnless(archive.append(u'more') == 10)
+        self.failUnless(os.path.getsize(self.path) == 4096)
+        archive.close()
+
+    def testSegmentFull(self):
+        archive = Archive(self.path, capacity=64)
+        elem = domish.Element((None, 'long'))
+        elem.addContent('x' * 64)
+        self.assertRaises(SerializationLimitError, archive.append, elem)
+        self.failUnless(len(archive) == 0)
+        self.failUnless(archive.append(u'fits') == 0)
+        archive.close()
+
+    def testClosed(self):
+        archive = Archive(self.path, capacity=4096)
+        archive.append(u'content')
+        record = archive[0]
+        archive.close()
+        self.assertRaises(ValueError, archive.append, u'more')
+        self.assertRaises(ValueError, str, record)
+
+    def testReentrant(self):
+        archive = Archive(self.path, capacity=4096)
+        refused = []
+
+        class Meddling(domish.Element):
+            def getChildren(self):
+                calls = {'close': archive.close,
+                         'append': lambda: archive.append(u'x'),
+                         'init': lambda: archive.__init__(self.path)}
+                for name, call in calls.items():
+                    try:
+                        call()
+                    except RuntimeError:
+                        refused.append(name)
+                return self._children
+            def setChildren(self, children):
+                self._children = children
+            children = property(getChildren, setChildren)
+
+        elem = Meddling((None, 'foo'))
+        elem.path = self.path
+        self.failUnless(archive.append(elem) == 0)
+        self.failUnless(set(refused) == set(['close', 'append', 'init']))
+        self.failUnless(len(archive) == 1)
+        self.failUnless(str(archive[0]) == "<foo/>")
+        archive.close()
+
+    def testCorrupt(self):
+        f = open(self.path, 'wb')
+        f.write('x' * 64)
+        f.close()
+        self.assertRaises(ValueError, Archive, self.path)